@@ -0,0 +1,61 @@
+#include "util.h"
+#include <iostream>
+#include <chrono>
+#include <iomanip>
+
+// The character-at-a-time strsplit that the splitter replaced, kept here to measure against
+std::vector<std::string> old_strsplit(const std::string &str, const std::string &delim)
+{
+	std::vector<std::string> ret{};
+	std::ostringstream cur{};
+	std::size_t i = 0;
+	while (i < str.size())
+	{
+		if (i <= str.size() - delim.size() && str.substr(i, delim.size()) == delim)
+		{
+			ret.push_back(cur.str());
+			cur.str(std::string{});
+			i += delim.size();
+		}
+		else
+		{
+			cur << str[i];
+			i += 1;
+		}
+	}
+	ret.push_back(cur.str());
+	return ret;
+}
+
+// Runs fn over the input enough times to take a measurable while and returns the time per run in microseconds
+template <typename F> double timeit(std::size_t size, F fn)
+{
+	std::size_t reps = std::max<std::size_t>(1, (64 << 20) / size);
+	std::size_t pieces = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < reps; i++) pieces += fn();
+	std::chrono::duration<double, std::micro> took = std::chrono::steady_clock::now() - start;
+	if (! pieces) std::cerr << "No pieces\n";
+	return took.count() / reps;
+}
+
+int main()
+{
+	// Comma-separated fields of varying length, like a CSV line
+	std::string unit{};
+	for (int i = 0; unit.size() < 4096; i++) unit += std::string(3 + i * 7 % 13, 'a' + i % 26) + ",";
+	for (std::size_t size : {std::size_t{1} << 10, std::size_t{1} << 20, std::size_t{100} << 20})
+	{
+		std::string in{};
+		in.reserve(size);
+		while (in.size() < size) in += unit;
+		in.resize(size);
+		std::cout << size << " bytes, microseconds per split:\n" << std::fixed << std::setprecision(1);
+		std::cout << "  old strsplit     " << timeit(size, [&in]() { return old_strsplit(in, ",").size(); }) << "\n";
+		std::cout << "  strsplit         " << timeit(size, [&in]() { return util::strsplit(in, ",").size(); }) << "\n";
+		std::cout << "  strsplit (char)  " << timeit(size, [&in]() { return util::strsplit(in, ',').size(); }) << "\n";
+		std::cout << "  strsplit_view    " << timeit(size, [&in]() { return util::strsplit_view(in, ",").size(); }) << "\n";
+		std::cout << "  splitter         " << timeit(size, [&in]() { std::size_t n = 0; for (std::string_view piece : util::splitter{in, ','}) n += ! piece.empty(); return n; }) << "\n";
+	}
+	return 0;
+}
@@ -0,0 +1,43 @@
+#include "template.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+// Runs fn reps times and returns the total time in milliseconds
+template <typename F> double timeit(int reps, F fn)
+{
+	std::size_t out = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < reps; i++) out += fn();
+	std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+	if (! out) std::cerr << "No output\n";
+	return took.count();
+}
+
+int main()
+{
+	// A table of 50 rows written out in full, since render has no loops, with substitutions, a ternary, arithmetic
+	// and a block in each row
+	const int rows = 50, reps = 200;
+	std::string src{"<html><head><title>{{title}}</title></head><body><table>\n"};
+	std::unordered_map<std::string, std::string> vars{{"title", "Inventory"}};
+	for (int i = 0; i < rows; i++)
+	{
+		std::string n = std::to_string(i);
+		src += "<tr class=\"{{odd" + n + "?odd:even}}\"><td>{{name" + n + "}}</td><td>{{qty" + n + "*2}}</td>{{#stock" + n + "?}}<td>in stock</td>{{/}}</tr>\n";
+		vars["name" + n] = "Item number " + n;
+		vars["qty" + n] = std::to_string(i * 3);
+		if (i % 2) vars["odd" + n] = "1";
+		if (i % 3) vars["stock" + n] = "1";
+	}
+	src += "</table></body></html>\n";
+	templ::compiled tmpl{src};
+	if (tmpl.render(vars) != templ::render(src, vars)) std::cerr << "Output differs\n";
+	std::cout << std::fixed << std::setprecision(1) << rows << "-row table rendered " << reps << " times, milliseconds:\n";
+	std::cout << "  render                     " << timeit(reps, [&src, &vars]() { return templ::render(src, vars).size(); }) << "\n";
+	std::cout << "  compile and render         " << timeit(reps, [&src, &vars]() { return templ::compiled{src}.render(vars).size(); }) << "\n";
+	std::cout << "  compiled::render           " << timeit(reps, [&tmpl, &vars]() { return tmpl.render(vars).size(); }) << "\n";
+	std::string buf{};
+	std::cout << "  compiled::render to buffer " << timeit(reps, [&tmpl, &vars, &buf]() { buf.clear(); tmpl.render(buf, vars); return buf.size(); }) << "\n";
+	return 0;
+}
@@ -2,90 +2,208 @@
 
 namespace html
 {
-	std::string xmlc2str(const xmlChar *s) { return std::string{reinterpret_cast<const char *>(s)}; } // TODO Why is reinterpret necessary?
+	std::string_view xmlc2view(const xmlChar *s) { return s ? std::string_view{reinterpret_cast<const char *>(s)} : std::string_view{}; } // TODO Why is reinterpret necessary?
+	std::string xmlc2str(const xmlChar *s) { return std::string{xmlc2view(s)}; }
 	const xmlChar *str2xmlc(const std::string &s) { return reinterpret_cast<const xmlChar *>(s.c_str()); }
 
+	// The HTML parser gives each attribute with a value a single text child holding it
+	std::string_view attrvalue(const xmlAttr *attr)
+	{
+		return attr->children ? xmlc2view(attr->children->content) : std::string_view{};
+	}
+
+	tag::attr_iterator::value_type tag::attr_iterator::operator*() const
+	{
+		return value_type{xmlc2view(attr_->name), attrvalue(attr_)};
+	}
+
 	std::string tag::name()
 	{
 		return xmlc2str(node_->name);
 	}
 
+	std::string_view tag::name_view() const
+	{
+		return xmlc2view(node_->name);
+	}
+
 	std::unordered_map<std::string, std::string> tag::props()
 	{
 		std::unordered_map<std::string, std::string> ret{};
-		for (xmlAttr *attr = node_->properties; attr; attr = attr->next)
-		{
-			ret[xmlc2str(attr->name)] = xmlc2str(attr->children->content);
-		}
+		for (std::pair<std::string_view, std::string_view> attr : attrs()) ret.emplace(attr.first, attr.second);
 		return ret;
 	}
 
+	std::string_view tag::attr(std::string_view name) const
+	{
+		for (std::pair<std::string_view, std::string_view> attr : attrs()) if (attr.first == name) return attr.second;
+		return std::string_view{};
+	}
+
+	bool tag::has_attr(std::string_view name) const
+	{
+		for (std::pair<std::string_view, std::string_view> attr : attrs()) if (attr.first == name) return true;
+		return false;
+	}
+
 	std::string tag::content()
 	{
 		return xmlc2str(node_->content);
 	}
 
-	std::vector<tag> tag::children()
+	std::string_view tag::content_view() const
 	{
-		std::vector<tag> ret{};
-		for (xmlNode *child = node_->children; child; child = child->next)
+		return xmlc2view(node_->content);
+	}
+
+	void tag::text(std::string &out) const
+	{
+		if (node_->type == XML_TEXT_NODE || node_->type == XML_CDATA_SECTION_NODE)
+		{
+			out += xmlc2view(node_->content);
+			return;
+		}
+		// Walk the subtree without recursing, climbing back up through parents once a branch is done
+		xmlNode *cur = node_->children;
+		while (cur)
 		{
-			ret.push_back(tag{child});
+			if (cur->type == XML_TEXT_NODE || cur->type == XML_CDATA_SECTION_NODE) out += xmlc2view(cur->content);
+			else if (cur->children && cur->type != XML_ENTITY_REF_NODE)
+			{
+				cur = cur->children;
+				continue;
+			}
+			while (cur && ! cur->next)
+			{
+				cur = cur->parent;
+				if (cur == node_) cur = nullptr;
+			}
+			if (cur) cur = cur->next;
 		}
+	}
+
+	std::string tag::text() const
+	{
+		std::string ret{};
+		text(ret);
 		return ret;
 	}
 
-	doc doc::parse_string(const std::string &in)
+	std::vector<tag> tag::children()
+	{
+		return std::vector<tag>(begin(), end());
+	}
+
+	compiled_xpath::compiled_xpath(const std::string &path) : expr_{xmlXPathCompile(str2xmlc(path))}
+	{
+		if (! expr_) throw std::runtime_error{"Failed to parse XPath expression " + path};
+	}
+
+	compiled_xpath::~compiled_xpath()
+	{
+		if (expr_) xmlXPathFreeCompExpr(expr_);
+	}
+
+	// libxml2 resets a parser context at the start of every read, so each thread only needs the one.  The reset keeps
+	// the context's name dictionary, though, which grows with every distinct element and attribute name ever parsed
+	// (XML_PARSE_NODICT doesn't stop that in 2.9), so the context is replaced every few hundred documents.
+	htmlParserCtxt *parser()
+	{
+		const unsigned int reuses = 256;
+		thread_local std::unique_ptr<htmlParserCtxt, void (*)(htmlParserCtxt *)> ctx{nullptr, htmlFreeParserCtxt};
+		thread_local unsigned int uses = 0;
+		if (! ctx || uses++ == reuses)
+		{
+			ctx.reset(htmlNewParserCtxt());
+			uses = 1;
+		}
+		if (! ctx) throw std::runtime_error{"Failed to create HTML parser context"};
+		return ctx.get();
+	}
+
+	doc doc::parse_string(std::string_view in)
 	{
-		return doc{htmlReadDoc(str2xmlc(in), NULL, NULL, parse_opts)};
+		return doc{htmlCtxtReadMemory(parser(), in.data(), in.size(), NULL, NULL, parse_opts)};
 	}
 
 	doc doc::read_file(const std::string &fname)
 	{
-		return doc{htmlReadFile(fname.c_str(), NULL, parse_opts)};
+		return doc{htmlCtxtReadFile(parser(), fname.c_str(), NULL, parse_opts)};
 	}
 
-	std::vector<tag> doc::xpath(const std::string &path)
+	doc &doc::operator=(doc &&orig)
+	{
+		if (this == &orig) return *this;
+		if (xpath_) xmlXPathFreeContext(xpath_);
+		xmlFreeDoc(doc_);
+		doc_ = orig.doc_;
+		xpath_ = orig.xpath_;
+		orig.doc_ = nullptr;
+		orig.xpath_ = nullptr;
+		return *this;
+	}
+
+	xmlXPathContext *doc::context()
 	{
-		xmlXPathContext *ctx = xmlXPathNewContext(doc_);
-		if (! ctx) throw std::runtime_error{"Failed to create XPath context"};
-		xmlXPathObject *obj = xmlXPathEvalExpression(str2xmlc(path), ctx);
-		if (! obj)
+		if (! xpath_)
 		{
-			xmlXPathFreeContext(ctx);
-			throw std::runtime_error{"Failed to parse XPath expression " + path};
+			xpath_ = xmlXPathNewContext(doc_);
+			if (! xpath_) throw std::runtime_error{"Failed to create XPath context"};
 		}
+		xpath_->node = nullptr; // Every query starts from the document
+		return xpath_;
+	}
+
+	// Takes ownership of the result of a query
+	std::vector<tag> doc::nodes(xmlXPathObject *obj)
+	{
+		if (! obj) throw std::runtime_error{"Failed to evaluate XPath expression"};
+		std::vector<tag> ret{};
 		if (obj->type != XPATH_NODESET)
 		{
-			xmlXPathFreeContext(ctx);
-			throw std::runtime_error{"XPath object type " + util::t2s(obj->type) + " is not supported"}; // TODO
+			int type = obj->type;
+			xmlXPathFreeObject(obj);
+			throw std::runtime_error{"XPath object type " + util::t2s(type) + " is not supported"}; // TODO
+		}
+		if (obj->nodesetval)
+		{
+			ret.reserve(obj->nodesetval->nodeNr);
+			for (int i = 0; i < obj->nodesetval->nodeNr; i++) ret.push_back(tag{obj->nodesetval->nodeTab[i]});
 		}
-		std::vector<tag> ret{};
-		if (! obj->nodesetval) return ret;
-		for (int i = 0; i < obj->nodesetval->nodeNr; i++) ret.push_back(tag{obj->nodesetval->nodeTab[i]});
-		xmlXPathFreeContext(ctx);
 		xmlXPathFreeObject(obj);
 		return ret;
 	}
 
+	std::vector<tag> doc::xpath(const std::string &path)
+	{
+		return xpath(compiled_xpath{path});
+	}
+
+	std::vector<tag> doc::xpath(const compiled_xpath &path)
+	{
+		return nodes(xmlXPathCompiledEval(path.get(), context()));
+	}
+
 	std::string doc::title()
 	{
-		std::vector<tag> matches = xpath("/html/head/title/text()");
+		thread_local const compiled_xpath path{"/html/head/title/text()"};
+		std::vector<tag> matches = xpath(path);
 		if (matches.empty()) return "";
 		return matches[0].content();
 	}
 
 	std::string doc::encoding()
 	{
+		thread_local const compiled_xpath charset_path{"//meta/@charset"}, http_path{"//meta[@http-equiv='Content-Type']/@content"};
+		thread_local const std::regex charset{"charset=([a-zA-Z0-9_-]+)"};
 		const xmlChar *lib = htmlGetMetaEncoding(doc_);
 		if (lib) return xmlc2str(lib);
-		std::vector<tag> meta = xpath("//meta/@charset");
-		if (meta.size() > 0) return meta[0].children()[0].content();
-		std::vector<tag> http = xpath("//meta[@http-equiv='Content-Type']/@content");
+		std::vector<tag> meta = xpath(charset_path);
+		if (meta.size() > 0) return meta[0].text();
+		std::vector<tag> http = xpath(http_path);
 		if (http.size() > 0)
 		{
-			std::string value = http[0].children()[0].content();
-			std::regex charset{"charset=([a-zA-Z0-9_-]+)"};
+			std::string value = http[0].text();
 			std::smatch res{};
 			if (std::regex_search(value, res, charset)) return res[1];
 		}
@@ -94,6 +212,128 @@ namespace html
 
 	doc::~doc()
 	{
+		if (xpath_) xmlXPathFreeContext(xpath_);
 		xmlFreeDoc(doc_);
 	}
+
+	extractor::extractor(const std::string &encoding) : watches_{}, open_{}, text_{}, depth_{0}, remaining_{0}, ctx_{nullptr}, error_{}
+	{
+		htmlSAXHandler sax{};
+		sax.startElement = start;
+		sax.endElement = end;
+		sax.characters = characters;
+		sax.cdataBlock = characters;
+		ctx_ = htmlCreatePushParserCtxt(&sax, this, nullptr, 0, nullptr, encoding.empty() ? XML_CHAR_ENCODING_NONE : xmlParseCharEncoding(encoding.c_str()));
+		if (! ctx_) throw std::runtime_error{"Failed to create HTML parser context"};
+		htmlCtxtUseOptions(ctx_, parse_opts);
+	}
+
+	extractor::~extractor()
+	{
+		if (! ctx_) return;
+		if (ctx_->myDoc) xmlFreeDoc(ctx_->myDoc);
+		htmlFreeParserCtxt(ctx_);
+	}
+
+	void extractor::on(const std::string &name, callback fn, bool text)
+	{
+		auto iter = watches_.find(name);
+		if (iter == watches_.end() || iter->second.done) remaining_++;
+		watches_[name] = watch{std::move(fn), text, false};
+	}
+
+	void extractor::stop()
+	{
+		xmlStopParser(ctx_);
+		remaining_ = 0;
+	}
+
+	// Exceptions can't unwind through libxml2, so the callbacks keep the first one for feed to rethrow
+	void extractor::start(void *self, const xmlChar *name, const xmlChar **atts)
+	{
+		extractor &ex = *static_cast<extractor *>(self);
+		ex.depth_++;
+		if (ex.error_ || ex.remaining_ == 0) return;
+		try
+		{
+			auto iter = ex.watches_.find(xmlc2str(name));
+			if (iter == ex.watches_.end() || iter->second.done) return;
+			attrs attributes{};
+			for (const xmlChar **att = atts; att && *att; att += 2) attributes.emplace_back(xmlc2str(att[0]), att[1] ? xmlc2str(att[1]) : "");
+			ex.open_.push_back(element{&iter->second, iter->first, std::move(attributes), ex.depth_, ex.text_.size()});
+		}
+		catch (...)
+		{
+			ex.error_ = std::current_exception();
+			ex.stop();
+		}
+	}
+
+	void extractor::end(void *self, const xmlChar *name)
+	{
+		extractor &ex = *static_cast<extractor *>(self);
+		std::size_t depth = ex.depth_--;
+		if (ex.open_.empty() || ex.open_.back().depth != depth) return;
+		element el = std::move(ex.open_.back());
+		ex.open_.pop_back();
+		try
+		{
+			if (! el.w->done && ex.remaining_ > 0 && ! el.w->fn(el.name, el.attributes, std::string_view{ex.text_}.substr(el.textstart)))
+			{
+				el.w->done = true;
+				if (--ex.remaining_ == 0) ex.stop();
+			}
+		}
+		catch (...)
+		{
+			ex.error_ = std::current_exception();
+			ex.stop();
+		}
+		if (ex.open_.empty()) ex.text_.clear();
+	}
+
+	void extractor::characters(void *self, const xmlChar *ch, int len)
+	{
+		extractor &ex = *static_cast<extractor *>(self);
+		for (const element &el : ex.open_) if (el.w->text)
+		{
+			ex.text_.append(reinterpret_cast<const char *>(ch), len);
+			return;
+		}
+	}
+
+	bool extractor::feed(std::string_view chunk)
+	{
+		if (! done())
+		{
+#if LIBXML_VERSION < 21400
+			// The HTML push parser before libxml2 2.14 (seen with 2.9.14, fed a few bytes at a time) can resume its
+			// search for the end of a tag from past the end of its input, and then stalls until the input is
+			// terminated.  checkIndex isn't public, but starting each search over only costs a rescan of the partial
+			// tag.  2.14 replaced that parser.
+			ctx_->checkIndex = 0;
+#endif
+			htmlParseChunk(ctx_, chunk.data(), chunk.size(), 0);
+		}
+		if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+		return ! done();
+	}
+
+	bool extractor::feed(std::istream &in)
+	{
+		std::string buf(64 * 1024, '\0');
+		while (in && ! done())
+		{
+			in.read(&buf[0], buf.size());
+			feed(std::string_view{buf.data(), static_cast<std::size_t>(in.gcount())});
+		}
+		finish();
+		return remaining_ == 0;
+	}
+
+	void extractor::finish()
+	{
+		if (! done()) htmlParseChunk(ctx_, nullptr, 0, 1);
+		if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+	}
 }
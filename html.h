@@ -5,6 +5,11 @@
 #include <unordered_map>
 #include <regex>
 #include <stdexcept>
+#include <functional>
+#include <exception>
+#include <utility>
+#include <iterator>
+#include <string_view>
 #include <libxml/HTMLparser.h>
 #include <libxml/HTMLtree.h>
 #include <libxml/xpath.h>
@@ -15,32 +20,153 @@
 
 namespace html
 {
+	// The _view accessors, attributes and iteration all point into the document, and are only valid as long as it is
 	class tag
 	{
 	private:
 		xmlNode *node_;
 	public:
+		class iterator
+		{
+		private:
+			xmlNode *node_;
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = tag;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = tag;
+			iterator(xmlNode *n) : node_{n} { }
+			tag operator*() const { return tag{node_}; }
+			iterator &operator++() { node_ = node_->next; return *this; }
+			iterator operator++(int) { iterator ret{*this}; ++*this; return ret; }
+			bool operator==(const iterator &other) const { return node_ == other.node_; }
+			bool operator!=(const iterator &other) const { return node_ != other.node_; }
+		};
+
+		class attr_iterator
+		{
+		private:
+			xmlAttr *attr_;
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = std::pair<std::string_view, std::string_view>;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = value_type;
+			attr_iterator(xmlAttr *a) : attr_{a} { }
+			value_type operator*() const;
+			attr_iterator &operator++() { attr_ = attr_->next; return *this; }
+			attr_iterator operator++(int) { attr_iterator ret{*this}; ++*this; return ret; }
+			bool operator==(const attr_iterator &other) const { return attr_ == other.attr_; }
+			bool operator!=(const attr_iterator &other) const { return attr_ != other.attr_; }
+		};
+
+		struct attr_range
+		{
+			xmlAttr *first;
+			attr_iterator begin() const { return attr_iterator{first}; }
+			attr_iterator end() const { return attr_iterator{nullptr}; }
+		};
+
 		tag(xmlNode *n) : node_{n} { }
+		xmlNode *get() const { return node_; }
 		std::string name();
+		std::string_view name_view() const;
 		std::unordered_map<std::string, std::string> props();
-		std::string content();
+		attr_range attrs() const { return attr_range{node_->type == XML_ELEMENT_NODE ? node_->properties : nullptr}; }
+		std::string_view attr(std::string_view name) const; // Empty if there's no such attribute
+		bool has_attr(std::string_view name) const;
+		std::string content(); // Of text and similar nodes; empty for elements
+		std::string_view content_view() const;
+		std::string text() const; // All the text under this node, concatenated
+		void text(std::string &out) const; // Appends to out
 		std::vector<tag> children();
+		iterator begin() const { return iterator{node_->children}; }
+		iterator end() const { return iterator{nullptr}; }
+	};
+
+	// An XPath expression parsed once, to be evaluated against any number of documents
+	class compiled_xpath
+	{
+	private:
+		xmlXPathCompExpr *expr_;
+	public:
+		compiled_xpath(const std::string &path);
+		compiled_xpath(const compiled_xpath &orig) = delete;
+		compiled_xpath(compiled_xpath &&orig) : expr_{orig.expr_} { orig.expr_ = nullptr; }
+		xmlXPathCompExpr *get() const { return expr_; }
+		virtual ~compiled_xpath();
 	};
 
+	// A parsed document.  Queries share one XPath context, made on the first of them, so a doc must not be queried
+	// from more than one thread at a time; separate docs can be used from separate threads freely.
 	class doc
 	{
 	private:
 		static constexpr int parse_opts = HTML_PARSE_RECOVER | HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING | HTML_PARSE_NONET;
 		xmlDoc *doc_;
-		doc(xmlDoc *d): doc_{d} { }
+		xmlXPathContext *xpath_; // Made on the first query and kept for the rest
+		doc(xmlDoc *d): doc_{d}, xpath_{nullptr} { }
+		xmlXPathContext *context();
+		std::vector<tag> nodes(xmlXPathObject *obj);
 	public:
-		static doc parse_string(const std::string &in);
+		// Parsing reuses a parser context kept for each thread, replaced every few hundred documents
+		static doc parse_string(std::string_view in);
 		static doc read_file(const std::string &fname);
+		doc(const doc &orig) = delete;
+		doc(doc &&orig) : doc_{orig.doc_}, xpath_{orig.xpath_} { orig.doc_ = nullptr; orig.xpath_ = nullptr; }
+		doc &operator=(const doc &orig) = delete;
+		doc &operator=(doc &&orig);
 		std::vector<tag> xpath(const std::string &path);
+		std::vector<tag> xpath(const compiled_xpath &path);
 		std::string title();
 		std::string encoding();
 		virtual ~doc();
 	};
+
+	// Pulls selected elements out of HTML fed in a chunk at a time, without building a tree.  Each element with a
+	// watched name is passed to its callback once it closes, with its attributes and, if asked for, all the text inside
+	// it.  A callback returns false when it has seen enough, and parsing stops early once every callback has.
+	class extractor
+	{
+	public:
+		using attrs = std::vector<std::pair<std::string, std::string>>;
+		using callback = std::function<bool(const std::string &name, const attrs &attributes, std::string_view text)>;
+	private:
+		static constexpr int parse_opts = HTML_PARSE_RECOVER | HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING | HTML_PARSE_NONET;
+		struct watch
+		{
+			callback fn;
+			bool text, done;
+		};
+		struct element
+		{
+			watch *w;
+			std::string name;
+			attrs attributes;
+			std::size_t depth, textstart;
+		};
+		std::unordered_map<std::string, watch> watches_;
+		std::vector<element> open_; // Watched elements that haven't closed yet
+		std::string text_; // Text inside open elements, shared by those nested in each other
+		std::size_t depth_, remaining_;
+		htmlParserCtxt *ctx_;
+		std::exception_ptr error_;
+		static void start(void *self, const xmlChar *name, const xmlChar **atts);
+		static void end(void *self, const xmlChar *name);
+		static void characters(void *self, const xmlChar *ch, int len);
+		void stop();
+	public:
+		extractor(const std::string &encoding = "");
+		extractor(const extractor &orig) = delete;
+		void on(const std::string &name, callback fn, bool text = true); // Element names are lowercase
+		bool feed(std::string_view chunk); // Returns false once parsing has stopped and further input would be ignored
+		bool feed(std::istream &in); // Feeds until the stream ends or parsing stops and finishes; returns whether it stopped
+		void finish(); // Closes any elements still open at the end of the input
+		bool done() const { return ! ctx_ || remaining_ == 0; }
+		virtual ~extractor();
+	};
 }
 
 #endif
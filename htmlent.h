@@ -1,262 +1,272 @@
 #ifndef UTIL_HTMLENT_H
 #define UTIL_HTMLENT_H
-#include <map>
-#include <string>
+#include <string_view>
+#include <utility>
+#include <iterator>
 
-const std::map<std::string, std::string> htmlent{
-	{"quot", "\""},
-	{"amp", "&"},
-	{"apos", "\'"},
-	{"lt", "<"},
-	{"gt", ">"},
-	{"nbsp", " "},
-	{"iexcl", "¡"},
-	{"cent", "¢"},
-	{"pound", "£"},
-	{"curren", "¤"},
-	{"yen", "¥"},
-	{"brvbar", "¦"},
-	{"sect", "§"},
-	{"uml", "¨"},
-	{"copy", "©"},
-	{"ordf", "ª"},
-	{"laquo", "«"},
-	{"not", "¬"},
-	{"shy", ""},
-	{"reg", "®"},
-	{"macr", "¯"},
-	{"deg", "°"},
-	{"plusmn", "±"},
-	{"sup2", "²"},
-	{"sup3", "³"},
-	{"acute", "´"},
-	{"micro", "µ"},
-	{"para", "¶"},
-	{"middot", "·"},
-	{"cedil", "¸"},
-	{"sup1", "¹"},
-	{"ordm", "º"},
-	{"raquo", "»"},
-	{"frac14", "¼"},
-	{"frac12", "½"},
-	{"frac34", "¾"},
-	{"iquest", "¿"},
-	{"Agrave", "À"},
+// Sorted by name so that lookups can be a binary search
+constexpr std::pair<std::string_view, std::string_view> htmlent[] = {
+	{"AElig", "Æ"},
 	{"Aacute", "Á"},
 	{"Acirc", "Â"},
+	{"Agrave", "À"},
+	{"Alpha", "Α"},
+	{"Aring", "Å"},
 	{"Atilde", "Ã"},
 	{"Auml", "Ä"},
-	{"Aring", "Å"},
-	{"AElig", "Æ"},
+	{"Beta", "Β"},
 	{"Ccedil", "Ç"},
-	{"Egrave", "È"},
+	{"Chi", "Χ"},
+	{"Dagger", "‡"},
+	{"Delta", "Δ"},
+	{"ETH", "Ð"},
 	{"Eacute", "É"},
 	{"Ecirc", "Ê"},
+	{"Egrave", "È"},
+	{"Epsilon", "Ε"},
+	{"Eta", "Η"},
 	{"Euml", "Ë"},
-	{"Igrave", "Ì"},
+	{"Gamma", "Γ"},
 	{"Iacute", "Í"},
 	{"Icirc", "Î"},
+	{"Igrave", "Ì"},
+	{"Iota", "Ι"},
 	{"Iuml", "Ï"},
-	{"ETH", "Ð"},
+	{"Kappa", "Κ"},
+	{"Lambda", "Λ"},
+	{"Mu", "Μ"},
 	{"Ntilde", "Ñ"},
-	{"Ograve", "Ò"},
+	{"Nu", "Ν"},
+	{"OElig", "Œ"},
 	{"Oacute", "Ó"},
 	{"Ocirc", "Ô"},
+	{"Ograve", "Ò"},
+	{"Omega", "Ω"},
+	{"Omicron", "Ο"},
+	{"Oslash", "Ø"},
 	{"Otilde", "Õ"},
 	{"Ouml", "Ö"},
-	{"times", "×"},
-	{"Oslash", "Ø"},
-	{"Ugrave", "Ù"},
+	{"Phi", "Φ"},
+	{"Pi", "Π"},
+	{"Prime", "″"},
+	{"Psi", "Ψ"},
+	{"Rho", "Ρ"},
+	{"Scaron", "Š"},
+	{"Sigma", "Σ"},
+	{"THORN", "Þ"},
+	{"Tau", "Τ"},
+	{"Theta", "Θ"},
 	{"Uacute", "Ú"},
 	{"Ucirc", "Û"},
+	{"Ugrave", "Ù"},
+	{"Upsilon", "Υ"},
 	{"Uuml", "Ü"},
+	{"Xi", "Ξ"},
 	{"Yacute", "Ý"},
-	{"THORN", "Þ"},
-	{"szlig", "ß"},
-	{"agrave", "à"},
+	{"Yuml", "Ÿ"},
+	{"Zeta", "Ζ"},
 	{"aacute", "á"},
 	{"acirc", "â"},
+	{"acute", "´"},
+	{"aelig", "æ"},
+	{"agrave", "à"},
+	{"alefsym", "ℵ"},
+	{"alpha", "α"},
+	{"amp", "&"},
+	{"and", "∧"},
+	{"ang", "∠"},
+	{"apos", "\'"},
+	{"aring", "å"},
+	{"asymp", "≈"},
 	{"atilde", "ã"},
 	{"auml", "ä"},
-	{"aring", "å"},
-	{"aelig", "æ"},
+	{"bdquo", "„"},
+	{"beta", "β"},
+	{"brvbar", "¦"},
+	{"bull", "•"},
+	{"cap", "∩"},
 	{"ccedil", "ç"},
-	{"egrave", "è"},
+	{"cedil", "¸"},
+	{"cent", "¢"},
+	{"chi", "χ"},
+	{"circ", "ˆ"},
+	{"clubs", "♣"},
+	{"cong", "≅"},
+	{"copy", "©"},
+	{"crarr", "↵"},
+	{"cup", "∪"},
+	{"curren", "¤"},
+	{"dArr", "⇓"},
+	{"dagger", "†"},
+	{"darr", "↓"},
+	{"deg", "°"},
+	{"delta", "δ"},
+	{"diams", "♦"},
+	{"divide", "÷"},
 	{"eacute", "é"},
 	{"ecirc", "ê"},
-	{"euml", "ë"},
-	{"igrave", "ì"},
-	{"iacute", "í"},
-	{"icirc", "î"},
-	{"iuml", "ï"},
+	{"egrave", "è"},
+	{"empty", "∅"},
+	{"emsp", " "},
+	{"ensp", " "},
+	{"epsilon", "ε"},
+	{"equiv", "≡"},
+	{"eta", "η"},
 	{"eth", "ð"},
-	{"ntilde", "ñ"},
-	{"ograve", "ò"},
-	{"oacute", "ó"},
-	{"ocirc", "ô"},
-	{"otilde", "õ"},
-	{"ouml", "ö"},
-	{"divide", "÷"},
-	{"oslash", "ø"},
-	{"ugrave", "ù"},
-	{"uacute", "ú"},
-	{"ucirc", "û"},
-	{"uuml", "ü"},
-	{"yacute", "ý"},
-	{"thorn", "þ"},
-	{"yuml", "ÿ"},
-	{"OElig", "Œ"},
-	{"oelig", "œ"},
-	{"Scaron", "Š"},
-	{"scaron", "š"},
-	{"Yuml", "Ÿ"},
+	{"euml", "ë"},
+	{"euro", "€"},
+	{"exist", "∃"},
 	{"fnof", "ƒ"},
-	{"circ", "ˆ"},
-	{"tilde", "˜"},
-	{"Alpha", "Α"},
-	{"Beta", "Β"},
-	{"Gamma", "Γ"},
-	{"Delta", "Δ"},
-	{"Epsilon", "Ε"},
-	{"Zeta", "Ζ"},
-	{"Eta", "Η"},
-	{"Theta", "Θ"},
-	{"Iota", "Ι"},
-	{"Kappa", "Κ"},
-	{"Lambda", "Λ"},
-	{"Mu", "Μ"},
-	{"Nu", "Ν"},
-	{"Xi", "Ξ"},
-	{"Omicron", "Ο"},
-	{"Pi", "Π"},
-	{"Rho", "Ρ"},
-	{"Sigma", "Σ"},
-	{"Tau", "Τ"},
-	{"Upsilon", "Υ"},
-	{"Phi", "Φ"},
-	{"Chi", "Χ"},
-	{"Psi", "Ψ"},
-	{"Omega", "Ω"},
-	{"alpha", "α"},
-	{"beta", "β"},
+	{"forall", "∀"},
+	{"frac12", "½"},
+	{"frac14", "¼"},
+	{"frac34", "¾"},
+	{"frasl", "⁄"},
 	{"gamma", "γ"},
-	{"delta", "δ"},
-	{"epsilon", "ε"},
-	{"zeta", "ζ"},
-	{"eta", "η"},
-	{"theta", "θ"},
+	{"ge", "≥"},
+	{"gt", ">"},
+	{"hArr", "⇔"},
+	{"harr", "↔"},
+	{"hearts", "♥"},
+	{"hellip", "…"},
+	{"iacute", "í"},
+	{"icirc", "î"},
+	{"iexcl", "¡"},
+	{"igrave", "ì"},
+	{"image", "ℑ"},
+	{"infin", "∞"},
+	{"int", "∫"},
 	{"iota", "ι"},
+	{"iquest", "¿"},
+	{"isin", "∈"},
+	{"iuml", "ï"},
 	{"kappa", "κ"},
+	{"lArr", "⇐"},
 	{"lambda", "λ"},
+	{"lang", "〈"},
+	{"laquo", "«"},
+	{"larr", "←"},
+	{"lceil", "⌈"},
+	{"ldquo", "“"},
+	{"le", "≤"},
+	{"lfloor", "⌊"},
+	{"lowast", "∗"},
+	{"loz", "◊"},
+	{"lrm", ""},
+	{"lsaquo", "‹"},
+	{"lsquo", "‘"},
+	{"lt", "<"},
+	{"macr", "¯"},
+	{"mdash", "—"},
+	{"micro", "µ"},
+	{"middot", "·"},
+	{"minus", "−"},
 	{"mu", "μ"},
+	{"nabla", "∇"},
+	{"nbsp", " "},
+	{"ndash", "–"},
+	{"ne", "≠"},
+	{"ni", "∋"},
+	{"not", "¬"},
+	{"notin", "∉"},
+	{"nsub", "⊄"},
+	{"ntilde", "ñ"},
 	{"nu", "ν"},
-	{"xi", "ξ"},
+	{"oacute", "ó"},
+	{"ocirc", "ô"},
+	{"oelig", "œ"},
+	{"ograve", "ò"},
+	{"oline", "‾"},
+	{"omega", "ω"},
 	{"omicron", "ο"},
-	{"pi", "π"},
-	{"rho", "ρ"},
-	{"sigmaf", "ς"},
-	{"sigma", "σ"},
-	{"tau", "τ"},
-	{"upsilon", "υ"},
+	{"oplus", "⊕"},
+	{"or", "∨"},
+	{"ordf", "ª"},
+	{"ordm", "º"},
+	{"oslash", "ø"},
+	{"otilde", "õ"},
+	{"otimes", "⊗"},
+	{"ouml", "ö"},
+	{"para", "¶"},
+	{"part", "∂"},
+	{"permil", "‰"},
+	{"perp", "⊥"},
 	{"phi", "φ"},
-	{"chi", "χ"},
-	{"psi", "ψ"},
-	{"omega", "ω"},
-	{"thetasym", "ϑ"},
-	{"upsih", "ϒ"},
+	{"pi", "π"},
 	{"piv", "ϖ"},
-	{"ensp", " "},
-	{"emsp", " "},
-	{"thinsp", " "},
-	{"zwnj", ""},
-	{"zwj", ""},
-	{"lrm", ""},
-	{"rlm", ""},
-	{"ndash", "–"},
-	{"mdash", "—"},
-	{"lsquo", "‘"},
-	{"rsquo", "’"},
-	{"sbquo", "‚"},
-	{"ldquo", "“"},
-	{"rdquo", "”"},
-	{"bdquo", "„"},
-	{"dagger", "†"},
-	{"Dagger", "‡"},
-	{"bull", "•"},
-	{"hellip", "…"},
-	{"permil", "‰"},
+	{"plusmn", "±"},
+	{"pound", "£"},
 	{"prime", "′"},
-	{"Prime", "″"},
-	{"lsaquo", "‹"},
-	{"rsaquo", "›"},
-	{"oline", "‾"},
-	{"frasl", "⁄"},
-	{"euro", "€"},
-	{"image", "ℑ"},
-	{"weierp", "℘"},
-	{"real", "ℜ"},
-	{"trade", "™"},
-	{"alefsym", "ℵ"},
-	{"larr", "←"},
-	{"uarr", "↑"},
-	{"rarr", "→"},
-	{"darr", "↓"},
-	{"harr", "↔"},
-	{"crarr", "↵"},
-	{"lArr", "⇐"},
-	{"uArr", "⇑"},
-	{"rArr", "⇒"},
-	{"dArr", "⇓"},
-	{"hArr", "⇔"},
-	{"forall", "∀"},
-	{"part", "∂"},
-	{"exist", "∃"},
-	{"empty", "∅"},
-	{"nabla", "∇"},
-	{"isin", "∈"},
-	{"notin", "∉"},
-	{"ni", "∋"},
 	{"prod", "∏"},
-	{"sum", "∑"},
-	{"minus", "−"},
-	{"lowast", "∗"},
-	{"radic", "√"},
 	{"prop", "∝"},
-	{"infin", "∞"},
-	{"ang", "∠"},
-	{"and", "∧"},
-	{"or", "∨"},
-	{"cap", "∩"},
-	{"cup", "∪"},
-	{"int", "∫"},
-	{"there4", "∴"},
+	{"psi", "ψ"},
+	{"quot", "\""},
+	{"rArr", "⇒"},
+	{"radic", "√"},
+	{"rang", "〉"},
+	{"raquo", "»"},
+	{"rarr", "→"},
+	{"rceil", "⌉"},
+	{"rdquo", "”"},
+	{"real", "ℜ"},
+	{"reg", "®"},
+	{"rfloor", "⌋"},
+	{"rho", "ρ"},
+	{"rlm", ""},
+	{"rsaquo", "›"},
+	{"rsquo", "’"},
+	{"sbquo", "‚"},
+	{"scaron", "š"},
+	{"sdot", "⋅"},
+	{"sect", "§"},
+	{"shy", ""},
+	{"sigma", "σ"},
+	{"sigmaf", "ς"},
 	{"sim", "∼"},
-	{"cong", "≅"},
-	{"asymp", "≈"},
-	{"ne", "≠"},
-	{"equiv", "≡"},
-	{"le", "≤"},
-	{"ge", "≥"},
+	{"spades", "♠"},
 	{"sub", "⊂"},
-	{"sup", "⊃"},
-	{"nsub", "⊄"},
 	{"sube", "⊆"},
+	{"sum", "∑"},
+	{"sup", "⊃"},
+	{"sup1", "¹"},
+	{"sup2", "²"},
+	{"sup3", "³"},
 	{"supe", "⊇"},
-	{"oplus", "⊕"},
-	{"otimes", "⊗"},
-	{"perp", "⊥"},
-	{"sdot", "⋅"},
-	{"lceil", "⌈"},
-	{"rceil", "⌉"},
-	{"lfloor", "⌊"},
-	{"rfloor", "⌋"},
-	{"lang", "〈"},
-	{"rang", "〉"},
-	{"loz", "◊"},
-	{"spades", "♠"},
-	{"clubs", "♣"},
-	{"hearts", "♥"},
-	{"diams", "♦"}
+	{"szlig", "ß"},
+	{"tau", "τ"},
+	{"there4", "∴"},
+	{"theta", "θ"},
+	{"thetasym", "ϑ"},
+	{"thinsp", " "},
+	{"thorn", "þ"},
+	{"tilde", "˜"},
+	{"times", "×"},
+	{"trade", "™"},
+	{"uArr", "⇑"},
+	{"uacute", "ú"},
+	{"uarr", "↑"},
+	{"ucirc", "û"},
+	{"ugrave", "ù"},
+	{"uml", "¨"},
+	{"upsih", "ϒ"},
+	{"upsilon", "υ"},
+	{"uuml", "ü"},
+	{"weierp", "℘"},
+	{"xi", "ξ"},
+	{"yacute", "ý"},
+	{"yen", "¥"},
+	{"yuml", "ÿ"},
+	{"zeta", "ζ"},
+	{"zwj", ""},
+	{"zwnj", ""}
 };
 
+constexpr bool htmlent_sorted()
+{
+	for (std::size_t i = 1; i < std::size(htmlent); i++) if (! (htmlent[i - 1].first < htmlent[i].first)) return false;
+	return true;
+}
+
+static_assert(htmlent_sorted(), "htmlent must be sorted by name with no duplicates");
+
 #endif
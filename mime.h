@@ -1,22 +1,27 @@
 #ifndef UTIL_MIME_H
 #define UTIL_MIME_H
-#include <map>
-#include <string>
+#include <string_view>
+#include <utility>
+#include <iterator>
 
 /* I could use a ridiculously long list of every MIME type ever, but this plus
  * libmagic should take care of nearly all cases.  Thanks to
  * http://lwp.interglacial.com/appc_01.htm for the original version of this
  * list.
+ *
+ * Keys are lowercase and must stay sorted, since lookups are a binary search.
+ * Compound extensions like "tar.gz" are matched before the last component
+ * alone.
  */
 
-const std::map<std::string, std::string> mime_types{
+constexpr std::pair<std::string_view, std::string_view> mime_types[] = {
 	{"au", "audio/basic"},
 	{"avi", "video/avi"},
 	{"bmp", "image/bmp"},
 	{"bz2", "application/x-bzip2"},
 	{"css", "text/css"},
-	{"dtd", "application/xml-dtd"},
 	{"doc", "application/msword"},
+	{"dtd", "application/xml-dtd"},
 	{"exe", "application/octet-stream"},
 	{"gif", "image/gif"},
 	{"gz", "application/x-gzip"},
@@ -50,7 +55,9 @@ const std::map<std::string, std::string> mime_types{
 	{"sit", "application/x-stuffit"},
 	{"svg", "image/svg+xml"},
 	{"swf", "application/x-shockwave-flash"},
-	{"gz", "application/x-tar"}, // FIXME This is a problem.  It should be .tar.gz, but I'm only checking the portion after the last period.
+	{"tar.bz2", "application/x-tar"},
+	{"tar.gz", "application/x-tar"},
+	{"tar.xz", "application/x-tar"},
 	{"tgz", "application/x-tar"},
 	{"tiff", "image/tiff"},
 	{"tsv", "text/tab-separated-values"},
@@ -60,7 +67,22 @@ const std::map<std::string, std::string> mime_types{
 	{"xml", "application/xml"},
 	{"xpm", "image/x-pixmap"},
 	{"xz", "application/x-xz"},
-	{"zip", "application/zip,"}
+	{"zip", "application/zip"}
 };
 
+constexpr bool mime_types_sorted()
+{
+	for (std::size_t i = 1; i < std::size(mime_types); i++) if (! (mime_types[i - 1].first < mime_types[i].first)) return false;
+	return true;
+}
+
+static_assert(mime_types_sorted(), "mime_types must be sorted by extension with no duplicates");
+
+constexpr std::size_t mime_ext_maxlen()
+{
+	std::size_t ret = 0;
+	for (const std::pair<std::string_view, std::string_view> &type : mime_types) if (type.first.size() > ret) ret = type.first.size();
+	return ret;
+}
+
 #endif
@@ -1,9 +1,11 @@
 #include "template.h"
+#include <charconv>
 
-bool is_uint(const std::string &s)
+bool is_uint(std::string_view s)
 {
-	const std::regex test{"^\\d+$"};
-	return std::regex_match(s, test);
+	if (s.empty()) return false;
+	for (char c : s) if (c < '0' || c > '9') return false;
+	return true;
 }
 
 int int_or_ref(const std::string &value, const std::unordered_map<std::string, std::string> &vars)
@@ -28,9 +30,11 @@ namespace templ
 		return split(in, 0, "", sep);
 	}
 
+	const std::regex re_compare{"^(\\w+)(=|==|!=)(.+)\\?$"}, re_mathcomp{"^(\\w+)(>|<|>=|<=)(\\w+)\\?$"}, re_exist{"^(\\w+)\\?$"};
+	const std::regex re_ternequal{"^(\\w+)=(.+?)\\?(.*?):(.*)$"}, re_ternary{"^(\\w+)\\?(.*?):(.*)$"}, re_arith{"^(\\w+)(\\+|-|\\*|/|%)(\\d+)$"}, re_sub{"^(\\w+)$"};
+
 	bool test(const std::string &expr, const std::unordered_map<std::string, std::string> &vars)
 	{
-		const static std::regex re_compare{"^(\\w+)(=|==|!=)(.+)\\?$"}, re_mathcomp{"^(\\w+)(>|<|>=|<=)(\\w+)\\?$"}, re_exist{"^(\\w+)\\?$"};
 		std::smatch match{};
 		if (std::regex_match(expr, match, re_compare))
 		{
@@ -55,7 +59,6 @@ namespace templ
 
 	std::string eval(const std::string &expr, const std::unordered_map<std::string, std::string> &vars)
 	{
-		const static std::regex re_ternequal{"^(\\w+)=(.+?)\\?(.*?):(.*)$"}, re_ternary{"^(\\w+)\\?(.*?):(.*)$"}, re_arith{"^(\\w+)(\\+|-|\\*|/|%)(\\d+)$"}, re_sub{"^(\\w+)$"};
 		std::smatch match{};
 		if (std::regex_match(expr, match, re_ternequal)) return (vars.count(match[1]) && vars.at(match[1]) == match[2]) ? match[3] : match[4];
 		if (std::regex_match(expr, match, re_ternary)) return (vars.count(match[1])) ? match[2] : match[3];
@@ -107,4 +110,382 @@ namespace templ
 		}
 		return ret.str();
 	}
+
+	long parse_long(std::string_view s)
+	{
+		long ret;
+		std::from_chars_result res = std::from_chars(s.data(), s.data() + s.size(), ret);
+		if (res.ec != std::errc{} || res.ptr != s.data() + s.size()) throw std::runtime_error{"Failed to convert \"" + std::string{s} + "\" to an integer"};
+		return ret;
+	}
+
+	compiled::operand compiled::mkoperand(const std::string &value)
+	{
+		if (is_uint(value)) return operand{false, parse_long(value), ""};
+		return operand{true, 0, value};
+	}
+
+	compiled::instr compiled::parse_test(const std::string &expr)
+	{
+		instr ret{};
+		std::smatch match{};
+		if (std::regex_match(expr, match, re_compare))
+		{
+			ret.code = op::compare;
+			ret.name = match[1];
+			ret.how = match[2] == "!=" ? oper::ne : oper::eq;
+			ret.value = match[3];
+		}
+		else if (std::regex_match(expr, match, re_mathcomp))
+		{
+			ret.code = op::mathcomp;
+			ret.l = mkoperand(match[1]);
+			ret.r = mkoperand(match[3]);
+			if (match[2] == ">") ret.how = oper::gt;
+			else if (match[2] == "<") ret.how = oper::lt;
+			else if (match[2] == ">=") ret.how = oper::ge;
+			else ret.how = oper::le;
+		}
+		else if (std::regex_match(expr, match, re_exist))
+		{
+			ret.code = op::exist;
+			ret.name = match[1];
+		}
+		else throw std::runtime_error{"Invalid test expression " + expr};
+		return ret;
+	}
+
+	compiled::instr compiled::parse_eval(const std::string &expr)
+	{
+		instr ret{};
+		std::smatch match{};
+		if (std::regex_match(expr, match, re_ternequal))
+		{
+			ret.code = op::ternequal;
+			ret.name = match[1];
+			ret.value = match[2];
+			ret.iftrue = match[3];
+			ret.iffalse = match[4];
+		}
+		else if (std::regex_match(expr, match, re_ternary))
+		{
+			ret.code = op::ternary;
+			ret.name = match[1];
+			ret.iftrue = match[2];
+			ret.iffalse = match[3];
+		}
+		else if (std::regex_match(expr, match, re_arith))
+		{
+			ret.code = op::arith;
+			ret.l = mkoperand(match[1]);
+			ret.r = mkoperand(match[3]);
+			if (match[2] == "+") ret.how = oper::add;
+			else if (match[2] == "-") ret.how = oper::sub;
+			else if (match[2] == "*") ret.how = oper::mul;
+			else if (match[2] == "/") ret.how = oper::div;
+			else ret.how = oper::mod;
+		}
+		else if (std::regex_match(expr, match, re_sub))
+		{
+			ret.code = op::sub;
+			ret.name = match[1];
+		}
+		else throw std::runtime_error{"Invalid evaluation expression " + expr};
+		return ret;
+	}
+
+	compiled::compiled(std::string in, const partials &parts) : src_{std::move(in)}, prog_{}, litsize_{0}
+	{
+		std::vector<std::size_t> blocks{};
+		auto literal = [this](std::size_t start, std::size_t end) {
+			if (end <= start) return;
+			instr lit{};
+			lit.code = op::literal;
+			lit.start = start;
+			lit.len = end - start;
+			prog_.push_back(std::move(lit));
+			litsize_ += end - start;
+		};
+		std::size_t pos = 0, search = 0;
+		while (true)
+		{
+			// Same tokens as render's regex: the shortest {{...}} that doesn't span a line break
+			std::size_t open = src_.find("{{", search);
+			if (open == std::string::npos) break;
+			std::size_t close = src_.find("}}", open + 2);
+			if (close == std::string::npos) break;
+			std::size_t newline = src_.find_first_of("\r\n", open + 2);
+			if (newline < close)
+			{
+				search = newline + 1;
+				continue;
+			}
+			literal(pos, open);
+			pos = search = close + 2;
+			const std::string cur = src_.substr(open + 2, close - open - 2);
+			if (cur.empty()) continue;
+			if (cur.compare(0, 6, "#each ") == 0)
+			{
+				instr each{};
+				each.code = op::each;
+				each.name = cur.substr(6);
+				if (! std::regex_match(each.name, re_sub)) throw std::runtime_error{"Invalid sequence name " + each.name};
+				blocks.push_back(prog_.size());
+				prog_.push_back(std::move(each));
+			}
+			else if (cur[0] == '>')
+			{
+				instr include{};
+				include.code = op::partial;
+				include.name = cur.substr(1);
+				auto iter = parts.find(include.name);
+				if (iter == parts.end() || ! iter->second) throw std::runtime_error{"Unknown partial " + include.name};
+				include.partial = iter->second;
+				litsize_ += include.partial->litsize_;
+				prog_.push_back(std::move(include));
+			}
+			else if (cur[0] == '#')
+			{
+				blocks.push_back(prog_.size());
+				prog_.push_back(parse_test(cur.substr(1)));
+			}
+			else if (cur[0] == '/')
+			{
+				if (blocks.empty()) throw std::runtime_error{"Unmatched end of block in template"};
+				prog_[blocks.back()].jump = prog_.size();
+				blocks.pop_back();
+			}
+			else prog_.push_back(parse_eval(cur));
+		}
+		literal(pos, src_.size());
+		for (std::size_t open : blocks) prog_[open].jump = prog_.size(); // Unclosed blocks run to the end
+	}
+
+	varlist &varlist::set(std::string_view name, value val)
+	{
+		for (std::pair<std::string_view, value> &var : vars_) if (var.first == name)
+		{
+			var.second = std::move(val);
+			return *this;
+		}
+		vars_.emplace_back(name, std::move(val));
+		return *this;
+	}
+
+	std::optional<value> varlist::get(std::string_view name) const
+	{
+		for (const std::pair<std::string_view, value> &var : vars_) if (var.first == name)
+		{
+			// Owned strings are handed out as views, which stay good as long as the list, rather than copied
+			if (const std::string *str = std::get_if<std::string>(&var.second)) return value{std::string_view{*str}};
+			return var.second;
+		}
+		return std::nullopt;
+	}
+
+	// Returns the textual form of a value, using buf for numbers
+	std::string_view strval(const value &val, char (&buf)[24])
+	{
+		if (const std::string_view *sv = std::get_if<std::string_view>(&val)) return *sv;
+		if (const std::string *str = std::get_if<std::string>(&val)) return *str;
+		long num;
+		if (const long *n = std::get_if<long>(&val)) num = *n;
+		else if (const sequence *const *seq = std::get_if<const sequence *>(&val)) num = *seq ? (*seq)->size() : 0;
+		else return "1";
+		return std::string_view{buf, static_cast<std::size_t>(std::to_chars(buf, buf + sizeof(buf), num).ptr - buf)};
+	}
+
+	std::optional<value> compiled::scope::get(const std::string &name) const
+	{
+		for (const scope *cur = this; cur; cur = cur->parent)
+		{
+			if (cur->map)
+			{
+				auto iter = cur->map->find(name);
+				if (iter != cur->map->end()) return value{std::string_view{iter->second}};
+			}
+			else if (cur->vars)
+			{
+				std::optional<value> ret = cur->vars->get(name);
+				if (ret) return ret;
+			}
+		}
+		return std::nullopt;
+	}
+
+	// Runs instructions begin through end, writing each piece of output with out(view).  Each blocks run their bodies
+	// recursively with an inner scope on the stack, and maps and varlists give out views of their strings, so rendering
+	// from them allocates nothing.  Values that a provider computes, like a fnprovider's, are its own cost.
+	template <typename Out> void compiled::exec(const scope &vars, Out &out, std::size_t begin, std::size_t end) const
+	{
+		auto get = [&vars](const std::string &name) {
+			std::optional<value> ret = vars.get(name);
+			if (ret && std::holds_alternative<bool>(*ret) && ! std::get<bool>(*ret)) ret.reset();
+			return ret;
+		};
+		char num[24];
+		auto intval = [&get, &num](const operand &o) {
+			if (! o.isref) return o.val;
+			std::optional<value> val = get(o.ref);
+			if (val && std::holds_alternative<long>(*val)) return std::get<long>(*val);
+			if (! val || ! is_uint(strval(*val, num))) throw std::runtime_error{"Value " + o.ref + " is not an integer or a reference to one"};
+			return parse_long(strval(*val, num));
+		};
+		for (std::size_t ip = begin; ip < end; ip++)
+		{
+			const instr &cur = prog_[ip];
+			std::optional<value> val;
+			switch (cur.code)
+			{
+			case op::literal:
+				out(std::string_view{src_}.substr(cur.start, cur.len));
+				break;
+			case op::sub:
+				if ((val = get(cur.name))) out(strval(*val, num));
+				break;
+			case op::ternequal:
+				val = get(cur.name);
+				out(std::string_view{val && strval(*val, num) == cur.value ? cur.iftrue : cur.iffalse});
+				break;
+			case op::ternary:
+				out(std::string_view{get(cur.name) ? cur.iftrue : cur.iffalse});
+				break;
+			case op::arith:
+			{
+				long l = intval(cur.l), r = intval(cur.r), res;
+				if (cur.how == oper::add) res = l + r;
+				else if (cur.how == oper::sub) res = l - r;
+				else if (cur.how == oper::mul) res = l * r;
+				else if (cur.how == oper::div) res = l / r;
+				else res = l % r;
+				out(strval(value{res}, num));
+				break;
+			}
+			case op::compare:
+				val = get(cur.name);
+				if (! val || (strval(*val, num) == cur.value) != (cur.how == oper::eq)) ip = cur.jump - 1;
+				break;
+			case op::mathcomp:
+			{
+				long l = intval(cur.l), r = intval(cur.r);
+				bool pass;
+				if (cur.how == oper::gt) pass = l > r;
+				else if (cur.how == oper::lt) pass = l < r;
+				else if (cur.how == oper::ge) pass = l >= r;
+				else pass = l <= r;
+				if (! pass) ip = cur.jump - 1;
+				break;
+			}
+			case op::exist:
+				if (! get(cur.name)) ip = cur.jump - 1;
+				break;
+			case op::each:
+			{
+				val = get(cur.name);
+				const sequence *const *seq = val ? std::get_if<const sequence *>(&*val) : nullptr;
+				if (seq && *seq) for (std::size_t i = 0; i < (*seq)->size(); i++)
+				{
+					scope inner{nullptr, &(*seq)->at(i), &vars};
+					exec(inner, out, ip + 1, cur.jump);
+				}
+				ip = cur.jump - 1;
+				break;
+			}
+			case op::partial:
+				cur.partial->exec(vars, out, 0, cur.partial->prog_.size());
+				break;
+			}
+		}
+	}
+
+	std::string compiled::render(const std::unordered_map<std::string, std::string> &vars) const
+	{
+		std::string ret{};
+		render(ret, vars);
+		return ret;
+	}
+
+	void compiled::render(std::ostream &out, const std::unordered_map<std::string, std::string> &vars) const
+	{
+		auto write = [&out](std::string_view s) { out.write(s.data(), s.size()); };
+		exec(scope{&vars, nullptr, nullptr}, write, 0, prog_.size());
+	}
+
+	void compiled::render(const std::function<void(std::string_view)> &sink, const std::unordered_map<std::string, std::string> &vars) const
+	{
+		exec(scope{&vars, nullptr, nullptr}, sink, 0, prog_.size());
+	}
+
+	void compiled::render(std::string &out, const std::unordered_map<std::string, std::string> &vars) const
+	{
+		out.reserve(out.size() + litsize_ + litsize_ / 4);
+		auto write = [&out](std::string_view s) { out.append(s); };
+		exec(scope{&vars, nullptr, nullptr}, write, 0, prog_.size());
+	}
+
+	std::string compiled::render(const provider &vars) const
+	{
+		std::string ret{};
+		render(ret, vars);
+		return ret;
+	}
+
+	void compiled::render(std::ostream &out, const provider &vars) const
+	{
+		auto write = [&out](std::string_view s) { out.write(s.data(), s.size()); };
+		exec(scope{nullptr, &vars, nullptr}, write, 0, prog_.size());
+	}
+
+	void compiled::render(const std::function<void(std::string_view)> &sink, const provider &vars) const
+	{
+		exec(scope{nullptr, &vars, nullptr}, sink, 0, prog_.size());
+	}
+
+	void compiled::render(std::string &out, const provider &vars) const
+	{
+		out.reserve(out.size() + litsize_ + litsize_ / 4);
+		auto write = [&out](std::string_view s) { out.append(s); };
+		exec(scope{nullptr, &vars, nullptr}, write, 0, prog_.size());
+	}
+
+	std::shared_ptr<const std::vector<compiled>> registry::get(const std::string &path, unsigned int sects)
+	{
+		struct stat st;
+		if (::stat(path.c_str(), &st)) throw std::runtime_error{"Could not stat template " + path + ": " + std::string{::strerror(errno)}};
+		auto current = [&st](const entry &e) {
+			return e.dev == st.st_dev && e.ino == st.st_ino && e.size == st.st_size && e.mtime.tv_sec == st.st_mtim.tv_sec && e.mtime.tv_nsec == st.st_mtim.tv_nsec;
+		};
+		std::shared_ptr<const std::vector<compiled>> ret{};
+		{
+			std::lock_guard<std::mutex> guard{lock_};
+			auto iter = cache_.find(path);
+			if (iter != cache_.end() && current(iter->second)) ret = iter->second.sections;
+		}
+		if (ret)
+		{
+			if (sects > 0 && ret->size() != sects) throw std::runtime_error{"Expected " + util::t2s(sects) + " sections in template " + path + ", but got " + util::t2s(ret->size())};
+			return ret;
+		}
+		util::mmap_guard map{path, util::mmapopt::sequential};
+		const std::string delim = "\n" + sep_ + "\n";
+		std::vector<compiled> sections{};
+		for (std::string_view sect : util::splitter{map.view(), delim}) sections.emplace_back(std::string{sect});
+		if (sects > 0 && sections.size() != sects) throw std::runtime_error{"Expected " + util::t2s(sects) + " sections in template " + path + ", but got " + util::t2s(sections.size())};
+		ret = std::make_shared<const std::vector<compiled>>(std::move(sections));
+		std::lock_guard<std::mutex> guard{lock_};
+		cache_[path] = entry{st.st_dev, st.st_ino, st.st_size, st.st_mtim, ret};
+		return ret;
+	}
+
+	void registry::forget(const std::string &path)
+	{
+		std::lock_guard<std::mutex> guard{lock_};
+		cache_.erase(path);
+	}
+
+	void registry::clear()
+	{
+		std::lock_guard<std::mutex> guard{lock_};
+		cache_.clear();
+	}
 }
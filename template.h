@@ -4,6 +4,14 @@
 #include <unordered_map>
 #include <vector>
 #include <regex>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <ostream>
+#include <optional>
+#include <variant>
+#include <initializer_list>
 #include "util.h"
 
 namespace templ
@@ -11,6 +19,177 @@ namespace templ
 	std::vector<std::string> split(const std::string &in, unsigned int sects, const std::string &id, const std::string &sep = "%");
 	std::vector<std::string> split(const std::string &in, const std::string &sep = "%");
 	std::string render(const std::string &in, const std::unordered_map<std::string, std::string> &vars);
+
+	class sequence;
+
+	// The value of a template variable.  Integers are used directly in arithmetic and comparisons and printed in decimal;
+	// false counts as unset and true prints as 1.  Sequences are for {{#each}} and otherwise act as their length.
+	using value = std::variant<std::string_view, std::string, long, bool, const sequence *>;
+
+	// A source of variables for compiled templates, for when building a map of strings is too costly.  get returns
+	// nothing for variables that aren't set.
+	class provider
+	{
+	public:
+		virtual std::optional<value> get(std::string_view name) const = 0;
+		virtual ~provider() { }
+	};
+
+	// A list of items for {{#each name}}...{{/}} to iterate over, each providing variables for one pass over the block
+	class sequence
+	{
+	public:
+		virtual std::size_t size() const = 0;
+		virtual const provider &at(std::size_t idx) const = 0;
+		virtual ~sequence() { }
+	};
+
+	// Variables in a flat list, searched linearly, which is faster than hashing for the handful of variables a template
+	// uses.  Names and string_view values are not copied, so they must outlive rendering.  Owned strings are looked up
+	// as views of the list's copy, so lookups never allocate.
+	class varlist : public provider
+	{
+	private:
+		std::vector<std::pair<std::string_view, value>> vars_;
+	public:
+		// One variable for the initializer list, taking the same types as set, so that a string literal is a
+		// string_view rather than ambiguous between the variant's string types
+		struct entry
+		{
+			std::string_view name;
+			value val;
+			entry(std::string_view n, value v) : name{n}, val{std::move(v)} { }
+			entry(std::string_view n, const char *v) : name{n}, val{std::string_view{v}} { }
+			entry(std::string_view n, long v) : name{n}, val{v} { }
+			entry(std::string_view n, int v) : name{n}, val{static_cast<long>(v)} { }
+			entry(std::string_view n, bool v) : name{n}, val{v} { }
+			entry(std::string_view n, const sequence &v) : name{n}, val{&v} { }
+		};
+		varlist() : vars_{} { }
+		varlist(std::initializer_list<entry> vars) : vars_{}
+		{
+			vars_.reserve(vars.size());
+			for (const entry &e : vars) vars_.emplace_back(e.name, e.val);
+		}
+		varlist &set(std::string_view name, value val);
+		varlist &set(std::string_view name, const char *val) { return set(name, value{std::string_view{val}}); }
+		varlist &set(std::string_view name, long val) { return set(name, value{val}); }
+		varlist &set(std::string_view name, int val) { return set(name, value{static_cast<long>(val)}); }
+		varlist &set(std::string_view name, bool val) { return set(name, value{val}); }
+		varlist &set(std::string_view name, const sequence &val) { return set(name, value{&val}); }
+		std::optional<value> get(std::string_view name) const;
+	};
+
+	// Variables computed on demand by a callback, so that values that the template never asks for cost nothing
+	class fnprovider : public provider
+	{
+	private:
+		std::function<std::optional<value>(std::string_view)> fn_;
+	public:
+		fnprovider(const std::function<std::optional<value>(std::string_view)> &fn) : fn_{fn} { }
+		std::optional<value> get(std::string_view name) const { return fn_(name); }
+	};
+
+	// Rows of variables to iterate over, such as the lines of a table.  Each row is a varlist, so an each block over
+	// them looks up owned strings without copying them.
+	class rowlist : public sequence
+	{
+	private:
+		std::vector<varlist> rows_;
+	public:
+		rowlist() : rows_{} { }
+		varlist &add() { rows_.emplace_back(); return rows_.back(); } // The reference is only good until the next add
+		void reserve(std::size_t n) { rows_.reserve(n); }
+		std::size_t size() const { return rows_.size(); }
+		const provider &at(std::size_t idx) const { return rows_[idx]; }
+	};
+
+	class compiled;
+
+	// Named templates that {{>name}} can include, given when compiling the template that includes them
+	using partials = std::unordered_map<std::string, std::shared_ptr<const compiled>>;
+
+	// A template that has been tokenized once into a list of instructions, so that it can be rendered any number of
+	// times without touching a regex.  Accepts the same language as render, plus {{#each name}}...{{/}} to repeat a block
+	// for every item of a sequence and {{>name}} to include a partial.  Variables inside an each block are looked up in
+	// the current item first and then outside it.
+	class compiled
+	{
+	private:
+		enum class op { literal, sub, ternequal, ternary, arith, compare, mathcomp, exist, each, partial };
+		enum class oper { eq, ne, gt, lt, ge, le, add, sub, mul, div, mod };
+		struct operand
+		{
+			bool isref;
+			long val;
+			std::string ref;
+		};
+		struct instr
+		{
+			op code;
+			oper how;
+			std::size_t start, len; // Span of the source for literal text
+			std::string name, value, iftrue, iffalse;
+			operand l, r;
+			std::size_t jump; // For blocks, the instruction following the end of the block
+			std::shared_ptr<const compiled> partial;
+		};
+		// One level of variable lookup, chained outward from the innermost each block
+		struct scope
+		{
+			const std::unordered_map<std::string, std::string> *map;
+			const provider *vars;
+			const scope *parent;
+			std::optional<value> get(const std::string &name) const;
+		};
+		std::string src_;
+		std::vector<instr> prog_;
+		std::size_t litsize_;
+		static operand mkoperand(const std::string &value);
+		instr parse_test(const std::string &expr);
+		instr parse_eval(const std::string &expr);
+		template <typename Out> void exec(const scope &vars, Out &out, std::size_t begin, std::size_t end) const;
+	public:
+		compiled(std::string in, const partials &parts = partials{}); // Moved from, if it can be, to keep as the source
+		compiled(const compiled &orig) = delete;
+		compiled(compiled &&orig) = default;
+		std::string render(const std::unordered_map<std::string, std::string> &vars) const;
+		// These write output as it is produced rather than building a string to return.  Literal text is passed on as
+		// views of the template source and substitutions as views of the variables, so nothing is copied on the way.
+		void render(std::ostream &out, const std::unordered_map<std::string, std::string> &vars) const;
+		void render(const std::function<void(std::string_view)> &sink, const std::unordered_map<std::string, std::string> &vars) const;
+		void render(std::string &out, const std::unordered_map<std::string, std::string> &vars) const; // Appends to out
+		std::string render(const provider &vars) const;
+		void render(std::ostream &out, const provider &vars) const;
+		void render(const std::function<void(std::string_view)> &sink, const provider &vars) const;
+		void render(std::string &out, const provider &vars) const;
+	};
+
+	// Loads template files, splits them into sections as split does, and keeps the compiled sections so that repeated
+	// lookups cost only a stat.  Files are mapped and split in place, so each section is copied once, into its compiled
+	// template.  A file is reloaded when its inode, size, or modification time changes.  Safe to share
+	// between threads; sections handed out stay valid even if the file is reloaded while they are in use.
+	class registry
+	{
+	private:
+		struct entry
+		{
+			dev_t dev;
+			ino_t ino;
+			off_t size;
+			struct timespec mtime;
+			std::shared_ptr<const std::vector<compiled>> sections;
+		};
+		std::string sep_;
+		std::mutex lock_;
+		std::unordered_map<std::string, entry> cache_;
+	public:
+		registry(const std::string &sep = "%") : sep_{sep}, lock_{}, cache_{} { }
+		registry(const registry &orig) = delete;
+		std::shared_ptr<const std::vector<compiled>> get(const std::string &path, unsigned int sects = 0);
+		void forget(const std::string &path);
+		void clear();
+	};
 }
 
 #endif
@@ -0,0 +1,25 @@
+#include "util.h"
+#include <iostream>
+#include <chrono>
+#include <sys/wait.h>
+
+// Children that outlive the timeout are killed on time, whether or not their output is still open
+int check(const std::string &name, const std::vector<std::string> &args, const util::sysio_opts &opts)
+{
+	auto start = std::chrono::steady_clock::now();
+	int status = util::sysio("sh", args, "", opts);
+	long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	bool ok = WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL && ms < 1000;
+	std::cout << (ok ? "pass" : "FAIL") << ": " << name << " returned " << status << " after " << ms << " ms\n";
+	return ok ? 0 : 1;
+}
+
+int main()
+{
+	util::sysio_opts opts{};
+	opts.timeout = std::chrono::milliseconds{300};
+	int fail = check("no callbacks", {"-c", "sleep 2"}, opts);
+	opts.out = [](std::string_view) { };
+	fail += check("output closed early", {"-c", "exec >&-; sleep 2"}, opts);
+	return fail ? 1 : 0;
+}
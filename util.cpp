@@ -1,37 +1,75 @@
 #include "util.h"
 #include "mime.h"
 #include "htmlent.h"
+#include "casemap.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 namespace util
 {
 	const int ftw_nopenfd = 256;
 
-	std::vector<std::string> strsplit(const std::string &str, const std::string &delim)
+	strsearch::strsearch(std::string_view needle) : data_{needle.data()}, len_{needle.size()}, first_{needle.size() ? needle[0] : '\0'}
 	{
-		std::vector<std::string> ret{};
-		std::ostringstream cur{};
-		std::size_t i = 0;
-		while (i < str.size())
+		if (len_ < horspool_min) return;
+		std::size_t maxskip = std::min(len_, static_cast<std::size_t>(255));
+		std::fill(std::begin(skip_), std::end(skip_), static_cast<unsigned char>(maxskip));
+		for (std::size_t i = len_ - maxskip; i < len_ - 1; i++) skip_[static_cast<unsigned char>(data_[i])] = static_cast<unsigned char>(len_ - 1 - i);
+	}
+
+	std::size_t strsearch::find(std::string_view hay, std::size_t pos) const
+	{
+		if (pos > hay.size() || hay.size() - pos < len_) return std::string_view::npos;
+		if (len_ == 0) return pos;
+		const char *base = hay.data(), *end = hay.data() + hay.size();
+		if (len_ < horspool_min)
 		{
-			if (i <= str.size() - delim.size() && str.substr(i, delim.size()) == delim)
-			{
-				ret.push_back(cur.str());
-				cur.str(std::string{});
-				i += delim.size();
-			}
-			else
+			for (const char *cur = base + pos; cur + len_ <= end; cur++)
 			{
-				cur << str[i];
-				i += 1;
+				cur = static_cast<const char *>(::memchr(cur, first_, end - cur - len_ + 1));
+				if (! cur) break;
+				if (len_ == 1 || ::memcmp(cur + 1, data_ + 1, len_ - 1) == 0) return cur - base;
 			}
+			return std::string_view::npos;
+		}
+		const char last = data_[len_ - 1];
+		for (std::size_t i = pos; i <= hay.size() - len_; )
+		{
+			const char c = base[i + len_ - 1];
+			if (c == last && ::memcmp(base + i, data_, len_ - 1) == 0) return i;
+			i += skip_[static_cast<unsigned char>(c)];
 		}
-		ret.push_back(cur.str());
+		return std::string_view::npos;
+	}
+
+	std::vector<std::string_view> strsplit_view(std::string_view str, std::string_view delim)
+	{
+		splitter split{str, delim};
+		return std::vector<std::string_view>(split.begin(), split.end());
+	}
+
+	std::vector<std::string_view> strsplit_view(std::string_view str, char delim)
+	{
+		splitter split{str, delim};
+		return std::vector<std::string_view>(split.begin(), split.end());
+	}
+
+	std::vector<std::string> strsplit(const std::string &str, const std::string &delim)
+	{
+		std::vector<std::string> ret{};
+		for (std::string_view piece : splitter{str, delim}) ret.emplace_back(piece);
 		return ret;
 	}
 
 	std::vector<std::string> strsplit(const std::string &str, char delim)
 	{
-		return strsplit(str, std::string(1, delim));
+		std::vector<std::string> ret{};
+		for (std::string_view piece : splitter{str, delim}) ret.emplace_back(piece);
+		return ret;
 	}
 
 	std::vector<std::string> strsplit(const std::string &str, const std::regex &delim)
@@ -120,52 +158,156 @@ namespace util
 		return std::make_pair(flags, args);
 	}
 
-	std::string gsub(const std::string &in, const std::string &find, const std::string &replace) // TODO Could be more efficient
+	std::string gsub(const std::string &in, const std::string &find, const std::string &replace)
 	{
-		std::ostringstream ret{};
-		for (size_t idx = 0; idx + find.size() <= in.size();)
+		if (find.empty()) return in;
+		strsearch search{find};
+		std::size_t count = 0;
+		for (std::size_t idx = search.find(in); idx != std::string::npos; idx = search.find(in, idx + find.size())) count++;
+		if (! count) return in;
+		std::string ret{};
+		ret.reserve(in.size() - count * find.size() + count * replace.size());
+		std::size_t last = 0;
+		for (std::size_t idx = search.find(in); idx != std::string::npos; idx = search.find(in, last))
+		{
+			ret.append(in, last, idx - last);
+			ret += replace;
+			last = idx + find.size();
+		}
+		ret.append(in, last, std::string::npos);
+		return ret;
+	}
+
+	multisub::multisub(const std::vector<std::pair<std::string, std::string>> &pairs) : class_{}, nclass_{1}, next_{}, match_{-1}, depth_{0}, pairs_{pairs}
+	{
+		// Bytes that appear in no pattern all share class 0, which keeps the transition table narrow
+		for (const std::pair<std::string, std::string> &pair : pairs_)
+		{
+			if (pair.first.empty()) throw std::runtime_error{"Empty pattern in substitution table"};
+			for (char c : pair.first) if (! class_[static_cast<uint8_t>(c)]) class_[static_cast<uint8_t>(c)] = static_cast<uint16_t>(nclass_++);
+		}
+		next_.assign(nclass_, -1);
+		for (std::size_t idx = 0; idx < pairs_.size(); idx++)
 		{
-			if (in.substr(idx, find.size()) == find)
+			int32_t state = 0;
+			for (char c : pairs_[idx].first)
 			{
-				ret << replace;
-				idx += find.size();
+				int32_t &edge = next_[state * nclass_ + class_[static_cast<uint8_t>(c)]];
+				if (edge < 0)
+				{
+					edge = match_.size();
+					next_.resize(next_.size() + nclass_, -1);
+					match_.push_back(-1);
+					depth_.push_back(depth_[state] + 1);
+				}
+				state = next_[state * nclass_ + class_[static_cast<uint8_t>(c)]];
 			}
-			else
+			if (match_[state] < 0) match_[state] = idx;
+		}
+		// Breadth-first pass to turn the trie into a complete transition table
+		std::vector<int32_t> fail(match_.size(), 0), queue{0};
+		for (std::size_t qi = 0; qi < queue.size(); qi++)
+		{
+			int32_t state = queue[qi];
+			for (std::size_t c = 0; c < nclass_; c++)
 			{
-				ret << in[idx];
-				idx += 1;
+				int32_t &edge = next_[state * nclass_ + c];
+				int32_t fallback = state ? next_[fail[state] * nclass_ + c] : 0;
+				if (edge < 0) edge = fallback;
+				else
+				{
+					fail[edge] = fallback;
+					if (match_[edge] < 0) match_[edge] = match_[fallback];
+					queue.push_back(edge);
+				}
 			}
 		}
-		return ret.str();
 	}
 
-	std::string conv(const std::string &in, const std::string &from, const std::string &to)
+	// Feeds buf[st.scan..] through the automaton.  For each piece of output, emit is called with a range of buf to copy
+	// verbatim followed by the index of the replacement to write, or -1 for none.  Unless final, text that could still
+	// be part of a match is held back and st.done marks how much of buf has been emitted.
+	template <typename Emit> void multisub::run(std::string_view buf, scanstate &st, bool final, Emit &&emit) const
 	{
-		iconv_t cd = ::iconv_open(to.c_str(), from.c_str());
-		if (cd == (iconv_t) -1) throw std::runtime_error{"Can't convert from " + from + " to " + to};
-		std::stringstream ret{};
-		std::string buf(256, '\0');
-		size_t nin = in.size(), nout = buf.size();
-		char *inaddr = const_cast<char *>(&in[0]); // I think iconv is supposed to take a `char * const *` rather than `char **` as its input....
-		char *outaddr = &buf[0];
-		while (nin > 0)
+		while (true)
 		{
-			size_t status = ::iconv(cd, &inaddr, &nin, &outaddr, &nout);
-			if (status == (size_t) -1)
+			while (st.scan < buf.size())
 			{
-				if (errno == E2BIG)
+				st.state = next_[st.state * nclass_ + class_[static_cast<uint8_t>(buf[st.scan++])]];
+				int32_t m = match_[st.state];
+				if (m >= 0)
+				{
+					std::size_t start = st.scan - pairs_[m].first.size();
+					if (st.best < 0 || start < st.beststart || (start == st.beststart && pairs_[m].first.size() > pairs_[st.best].first.size()))
+					{
+						st.best = m;
+						st.beststart = start;
+					}
+				}
+				if (st.best >= 0 && st.scan - depth_[st.state] > st.beststart)
 				{
-					ret << buf.substr(0, buf.size() - nout);
-					nout = buf.size();
-					outaddr = &buf[0];
+					emit(st.done, st.beststart, st.best);
+					st.done = st.scan = st.beststart + pairs_[st.best].first.size();
+					st.state = 0;
+					st.best = -1;
 				}
-				else throw std::runtime_error{"Couldn't convert string: " + std::string{::strerror(errno)}};
 			}
+			if (! final || st.best < 0) break;
+			emit(st.done, st.beststart, st.best);
+			st.done = st.scan = st.beststart + pairs_[st.best].first.size();
+			st.state = 0;
+			st.best = -1;
+		}
+		std::size_t limit = final ? buf.size() : st.scan - depth_[st.state];
+		if (limit > st.done) emit(st.done, limit, -1);
+		st.done = limit;
+	}
+
+	std::string multisub::operator()(std::string_view in) const
+	{
+		std::vector<std::pair<std::size_t, int32_t>> matches{};
+		std::size_t size = in.size();
+		scanstate st{};
+		run(in, st, true, [&matches, &size, this](std::size_t from, std::size_t to, int32_t idx) {
+			if (idx < 0) return;
+			matches.emplace_back(to, idx);
+			size = size - pairs_[idx].first.size() + pairs_[idx].second.size();
+		});
+		std::string ret{};
+		ret.reserve(size);
+		std::size_t last = 0;
+		for (const std::pair<std::size_t, int32_t> &match : matches)
+		{
+			ret.append(in.substr(last, match.first - last));
+			ret += pairs_[match.second].second;
+			last = match.first + pairs_[match.second].first.size();
+		}
+		ret.append(in.substr(last));
+		return ret;
+	}
+
+	void multisub::operator()(std::istream &in, std::ostream &out, std::size_t chunk) const
+	{
+		std::string buf{};
+		scanstate st{};
+		bool final = false;
+		while (! final)
+		{
+			std::size_t old = buf.size();
+			buf.resize(old + chunk);
+			in.read(&buf[old], chunk);
+			buf.resize(old + in.gcount());
+			if (in.bad()) throw std::runtime_error{"Failed to read input for substitution"};
+			final = ! in;
+			run(buf, st, final, [&buf, &out, this](std::size_t from, std::size_t to, int32_t idx) {
+				out.write(buf.data() + from, to - from);
+				if (idx >= 0) out << pairs_[idx].second;
+			});
+			buf.erase(0, st.done);
+			st.scan -= st.done;
+			st.beststart -= std::min(st.beststart, st.done);
+			st.done = 0;
 		}
-		buf.resize(outaddr - &buf[0]);
-		ret << buf;
-		::iconv_close(cd);
-		return ret.str();
 	}
 
 	std::string env_or(const std::string &var, const std::string &def)
@@ -183,30 +325,364 @@ namespace util
 		return convert.to_bytes(ss.str());
 	}
 
+	// Decodes one code point from the start of s, returning the number of bytes it took, or 0 if s doesn't start with
+	// a valid, minimally-encoded UTF-8 sequence.
+	std::size_t utf8decode(const char *s, std::size_t len, char32_t &cp)
+	{
+		const unsigned char *u = reinterpret_cast<const unsigned char *>(s);
+		std::size_t n;
+		if (u[0] < 0x80) { cp = u[0]; return 1; }
+		else if ((u[0] & 0xe0) == 0xc0) { n = 2; cp = u[0] & 0x1f; }
+		else if ((u[0] & 0xf0) == 0xe0) { n = 3; cp = u[0] & 0x0f; }
+		else if ((u[0] & 0xf8) == 0xf0) { n = 4; cp = u[0] & 0x07; }
+		else return 0;
+		if (len < n) return 0;
+		for (std::size_t i = 1; i < n; i++)
+		{
+			if ((u[i] & 0xc0) != 0x80) return 0;
+			cp = (cp << 6) | (u[i] & 0x3f);
+		}
+		static const char32_t minval[] = {0, 0, 0x80, 0x800, 0x10000};
+		if (cp < minval[n] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) return 0;
+		return n;
+	}
+
+	// Writes the UTF-8 encoding of a valid code point to out, which must have room for four bytes, and returns its length
+	std::size_t utf8encode(char32_t cp, char *out)
+	{
+		if (cp < 0x80)
+		{
+			out[0] = static_cast<char>(cp);
+			return 1;
+		}
+		if (cp < 0x800)
+		{
+			out[0] = static_cast<char>(0xc0 | (cp >> 6));
+			out[1] = static_cast<char>(0x80 | (cp & 0x3f));
+			return 2;
+		}
+		if (cp < 0x10000)
+		{
+			out[0] = static_cast<char>(0xe0 | (cp >> 12));
+			out[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+			out[2] = static_cast<char>(0x80 | (cp & 0x3f));
+			return 3;
+		}
+		out[0] = static_cast<char>(0xf0 | (cp >> 18));
+		out[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+		out[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+		out[3] = static_cast<char>(0x80 | (cp & 0x3f));
+		return 4;
+	}
+
+	bool utf8valid(std::string_view str)
+	{
+		std::size_t i = 0;
+		while (i < str.size())
+		{
+			uint64_t word;
+			if (i + 8 <= str.size() && (::memcpy(&word, str.data() + i, 8), (word & 0x8080808080808080ull) == 0))
+			{
+				i += 8;
+				continue;
+			}
+			char32_t cp;
+			std::size_t len = utf8decode(str.data() + i, str.size() - i, cp);
+			if (len == 0) return false;
+			i += len;
+		}
+		return true;
+	}
+
+	// Whether the undecodable UTF-8 at the start of s, up to len bytes, is only the beginning of a character cut short
+	bool utf8truncated(const char *s, std::size_t len)
+	{
+		unsigned char lead = s[0];
+		std::size_t n = (lead & 0xe0) == 0xc0 ? 2 : (lead & 0xf0) == 0xe0 ? 3 : (lead & 0xf8) == 0xf0 ? 4 : 0;
+		if (len >= n) return false;
+		for (std::size_t i = 1; i < len; i++) if ((s[i] & 0xc0) != 0x80) return false;
+		return true;
+	}
+
+	// Encoding names as iconv would match them, ignoring case and punctuation
+	std::string encoding_key(const std::string &name)
+	{
+		std::string ret{};
+		for (char c : name) if (std::isalnum(static_cast<unsigned char>(c))) ret += std::toupper(static_cast<unsigned char>(c));
+		return ret;
+	}
+
+	converter::converter(const std::string &from, const std::string &to) : cd_{(iconv_t) -1}, path_{path::iconv}
+	{
+		std::string f = encoding_key(from), t = encoding_key(to);
+		auto latin1 = [](const std::string &name) { return name == "LATIN1" || name == "ISO88591" || name == "L1"; };
+		if (f == "UTF8" && t == "UTF8") path_ = path::utf8;
+		else if (latin1(f) && t == "UTF8") path_ = path::latin1_utf8;
+		else if (f == "UTF8" && latin1(t)) path_ = path::utf8_latin1;
+		else
+		{
+			cd_ = ::iconv_open(to.c_str(), from.c_str());
+			if (cd_ == (iconv_t) -1) throw std::runtime_error{"Can't convert from " + from + " to " + to};
+		}
+	}
+
+	converter::~converter()
+	{
+		if (cd_ != (iconv_t) -1) ::iconv_close(cd_);
+	}
+
+	void converter::reset()
+	{
+		if (cd_ != (iconv_t) -1) ::iconv(cd_, nullptr, nullptr, nullptr, nullptr);
+	}
+
+	std::size_t converter::partial(std::string_view in, std::string &out)
+	{
+		const std::size_t start = out.size();
+		auto fail = [this, &out, start](int err) {
+			out.resize(start);
+			reset();
+			return std::runtime_error{"Couldn't convert string: " + std::string{::strerror(err)}};
+		};
+		if (path_ == path::latin1_utf8)
+		{
+			out.reserve(start + in.size() * 2);
+			for (char c : in)
+			{
+				if (static_cast<unsigned char>(c) < 0x80) out += c;
+				else
+				{
+					out += static_cast<char>(0xc0 | (static_cast<unsigned char>(c) >> 6));
+					out += static_cast<char>(0x80 | (c & 0x3f));
+				}
+			}
+			return in.size();
+		}
+		if (path_ == path::utf8 || path_ == path::utf8_latin1)
+		{
+			std::size_t i = 0;
+			if (path_ == path::utf8_latin1) out.reserve(start + in.size());
+			while (i < in.size())
+			{
+				char32_t cp;
+				std::size_t len = utf8decode(in.data() + i, in.size() - i, cp);
+				if (len == 0)
+				{
+					if (utf8truncated(in.data() + i, in.size() - i)) break;
+					throw fail(EILSEQ);
+				}
+				if (path_ == path::utf8_latin1)
+				{
+					if (cp > 0xff) throw fail(EILSEQ);
+					out += static_cast<char>(cp);
+				}
+				i += len;
+			}
+			if (path_ == path::utf8) out.append(in.data(), i);
+			return i;
+		}
+		char *inaddr = const_cast<char *>(in.data()); // I think iconv is supposed to take a `char * const *` rather than `char **` as its input....
+		std::size_t nin = in.size(), used = start;
+		out.resize(start + in.size() + in.size() / 2 + 16);
+		while (true)
+		{
+			char *outaddr = &out[used];
+			std::size_t nout = out.size() - used;
+			std::size_t status = ::iconv(cd_, &inaddr, &nin, &outaddr, &nout);
+			used = outaddr - &out[0];
+			if (status != (std::size_t) -1) break;
+			if (errno == E2BIG) out.resize(out.size() * 2);
+			else if (errno == EINVAL) break; // Incomplete character at the end
+			else throw fail(errno);
+		}
+		out.resize(used);
+		return in.size() - nin;
+	}
+
+	void converter::finish(std::string &out)
+	{
+		if (cd_ == (iconv_t) -1) return;
+		std::size_t used = out.size();
+		out.resize(used + 16);
+		while (true)
+		{
+			char *outaddr = &out[used];
+			std::size_t nout = out.size() - used;
+			std::size_t status = ::iconv(cd_, nullptr, nullptr, &outaddr, &nout);
+			used = outaddr - &out[0];
+			if (status != (std::size_t) -1 || errno != E2BIG) break;
+			out.resize(out.size() * 2);
+		}
+		out.resize(used);
+		reset();
+	}
+
+	void converter::operator()(std::string_view in, std::string &out)
+	{
+		std::size_t start = out.size();
+		if (partial(in, out) < in.size())
+		{
+			out.resize(start);
+			reset();
+			throw std::runtime_error{"Couldn't convert string: " + std::string{::strerror(EINVAL)}};
+		}
+		finish(out);
+	}
+
+	std::string converter::operator()(std::string_view in)
+	{
+		std::string ret{};
+		(*this)(in, ret);
+		return ret;
+	}
+
+	converter &converter::get(const std::string &from, const std::string &to)
+	{
+		thread_local std::unordered_map<std::string, converter> cache{};
+		std::string key = from + '\0' + to;
+		auto iter = cache.find(key);
+		if (iter == cache.end()) iter = cache.emplace(key, converter{from, to}).first;
+		return iter->second;
+	}
+
+	std::string conv(const std::string &in, const std::string &from, const std::string &to)
+	{
+		return converter::get(from, to)(in);
+	}
+
+	template <std::size_t N> char32_t casemap(char32_t cp, const caserange (&table)[N])
+	{
+		const caserange *run = std::upper_bound(table, table + N, cp, [](char32_t c, const caserange &r) { return c < r.lo; });
+		if (run == table) return cp;
+		run--;
+		if (cp > run->hi || (cp - run->lo) % run->stride) return cp;
+		return cp + run->delta;
+	}
+
+	// Case-maps the longest ASCII prefix of in into out, which may be the same buffer, and returns its length
+	std::size_t asciicase(const char *in, char *out, std::size_t len, bool upper)
+	{
+		const char first = upper ? 'a' : 'A', flip = 'a' - 'A';
+		std::size_t i = 0;
+#ifdef __SSE2__
+		const __m128i lo = _mm_set1_epi8(first - 1), hi = _mm_set1_epi8(first + 26), bit = _mm_set1_epi8(flip);
+		for (; i + 16 <= len; i += 16)
+		{
+			__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+			if (_mm_movemask_epi8(block)) break;
+			__m128i mask = _mm_and_si128(_mm_cmpgt_epi8(block, lo), _mm_cmplt_epi8(block, hi));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_xor_si128(block, _mm_and_si128(mask, bit)));
+		}
+#endif
+		for (; i < len && ! (in[i] & 0x80); i++) out[i] = in[i] >= first && in[i] < first + 26 ? in[i] ^ flip : in[i];
+		return i;
+	}
+
+	void utf8case(std::string_view str, std::string &out, bool upper)
+	{
+		std::size_t w = out.size(), i = 0;
+		out.resize(w + str.size()); // Invariant: out has room for the rest of the input at its current length
+		while (i < str.size())
+		{
+			std::size_t n = asciicase(str.data() + i, &out[w], str.size() - i, upper);
+			i += n;
+			w += n;
+			if (i == str.size()) break;
+			char32_t cp;
+			std::size_t inlen = utf8decode(str.data() + i, str.size() - i, cp);
+			if (! inlen)
+			{
+				out[w++] = str[i++];
+				continue;
+			}
+			char enc[4];
+			std::size_t outlen = utf8encode(upper ? casemap(cp, case_upper) : casemap(cp, case_lower), enc);
+			i += inlen;
+			if (out.size() < w + outlen + str.size() - i) out.resize(w + outlen + str.size() - i);
+			std::copy(enc, enc + outlen, &out[w]);
+			w += outlen;
+		}
+		out.resize(w);
+	}
+
+	void utf8case_inplace(std::string &str, bool upper)
+	{
+		std::size_t w = 0, i = 0;
+		while (i < str.size())
+		{
+			std::size_t n = asciicase(&str[i], &str[w], str.size() - i, upper);
+			i += n;
+			w += n;
+			if (i == str.size()) break;
+			char32_t cp;
+			std::size_t inlen = utf8decode(&str[i], str.size() - i, cp);
+			if (! inlen)
+			{
+				str[w++] = str[i++];
+				continue;
+			}
+			char enc[4];
+			std::size_t outlen = utf8encode(upper ? casemap(cp, case_upper) : casemap(cp, case_lower), enc);
+			if (outlen > inlen + i - w) // A few mappings lengthen their code point; finish those strings out of place
+			{
+				std::string tail = str.substr(i);
+				str.resize(w);
+				utf8case(tail, str, upper);
+				return;
+			}
+			std::copy(enc, enc + outlen, &str[w]);
+			i += inlen;
+			w += outlen;
+		}
+		str.resize(w);
+	}
+
 	std::string utf8lower(const std::string &str)
 	{
-		std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> convert{"�", L"�"};
-		std::basic_ostringstream<wchar_t> ss{};
-		for (const wchar_t &c : convert.from_bytes(str)) ss << std::tolower(c, std::locale{ucslocale});
-		return convert.to_bytes(ss.str());
+		std::string ret{};
+		utf8case(str, ret, false);
+		return ret;
 	}
 
 	std::string utf8upper(const std::string &str)
 	{
-		std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> convert{"�", L"�"};
-		std::basic_ostringstream<wchar_t> ss{};
-		for (const wchar_t &c : convert.from_bytes(str)) ss << std::toupper(c, std::locale{ucslocale});
-		return convert.to_bytes(ss.str());
+		std::string ret{};
+		utf8case(str, ret, true);
+		return ret;
+	}
+
+	void utf8lower(std::string_view str, std::string &out)
+	{
+		utf8case(str, out, false);
+	}
+
+	void utf8upper(std::string_view str, std::string &out)
+	{
+		utf8case(str, out, true);
+	}
+
+	void utf8lower_inplace(std::string &str)
+	{
+		utf8case_inplace(str, false);
+	}
+
+	void utf8upper_inplace(std::string &str)
+	{
+		utf8case_inplace(str, true);
+	}
+
+	void codepoint2utf8(char32_t codepoint, std::string &out)
+	{
+		if (codepoint > 0x10ffff || (codepoint >= 0xd800 && codepoint <= 0xdfff))
+			throw std::runtime_error{"Could not convert invalid code point " + t2s(static_cast<uint32_t>(codepoint)) + " to UTF-8"};
+		char buf[4];
+		out.append(buf, utf8encode(codepoint, buf));
 	}
 
 	std::string codepoint2utf8(char32_t codepoint)
 	{
-		setlocale(LC_ALL, ucslocale.c_str()); // FIXME Not thread-safe
-		std::mbstate_t state{};
-		std::string ret(MB_CUR_MAX, '\0');
-		int size = std::c32rtomb(&ret[0], codepoint, &state);
-		if (size < 0) throw std::runtime_error{"Could not convert invalid code point " + t2s(codepoint) + " to UTF-8"};
-		ret.resize(size);
+		std::string ret{};
+		codepoint2utf8(codepoint, ret);
 		return ret;
 	}
 
@@ -244,17 +720,6 @@ namespace util
 		if (fail) throw std::runtime_error{"Could not rmdir " + path + ": " + std::string{::strerror(errno)}};
 	}
 
-	bool rm_pred(const std::string &path, const struct stat *st, void *arg)
-	{
-		rm(path);
-		return true;
-	}
-
-	void rm_recursive(const std::string &path)
-	{
-		fswalk(path, rm_pred, nullptr, fswopt::depth);
-	}
-
 	void mkdir(const std::string &path, int mode, bool skipexist)
 	{
 		if (::mkdir(path.c_str(), mode) < 0)
@@ -264,17 +729,6 @@ namespace util
 		}
 	}
 
-	void cp(const std::string &src, const std::string &dest)
-	{
-		std::ifstream in{src};
-		if (! in) throw std::runtime_error{"Couldn't open " + src + " for reading"};
-		in.exceptions(std::ios_base::badbit);
-		std::ofstream out{dest};
-		if (! out) throw std::runtime_error{"Couldn't open " + dest + " for writing"};
-		out.exceptions(std::ios_base::badbit);
-		out << in.rdbuf();
-	}
-
 	std::string exepath()
 	{
 		std::string ret(2048, '\0');
@@ -315,86 +769,615 @@ namespace util
 		return fexists(path) && ! isdir(path);
 	}
 
-	std::unordered_set<std::string> ls(const std::string &dir, const std::string &test)
+	dirlist::filter dirlist::glob(const std::string &pattern, int flags)
 	{
-		std::unordered_set<std::string> ret{};
-		std::regex *testre = nullptr;
-		if (test != "") testre = new std::regex{test};
-		DIR *d = ::opendir(dir.c_str());
-		if (! d) throw std::runtime_error{"Couldn't open directory " + dir};
-		struct dirent *file;
-		while ((file = ::readdir(d)))
-		{
-			std::string fname{file->d_name};
-			if (fname == "." || fname == "..") continue;
-			if (testre && ! std::regex_search(fname, *testre)) continue;
-			ret.insert(fname);
-		}
-		::closedir(d);
-		delete testre;
-		return ret;
+		return [pattern, flags](const entry &e) { return ::fnmatch(pattern.c_str(), e.name.data(), flags) == 0; };
 	}
 
-	void fswalk(const std::string &path, const std::function<bool(const std::string &, const struct stat *, void *)> &fn, void *userd, int flags)
+	dirlist::filter dirlist::match(const std::regex &re)
 	{
-		int statret;
-		struct stat sb;
-		bool follow = flags & fswopt::follow, depth = flags & fswopt::depth;
-		if (follow) statret = ::stat(path.c_str(), &sb);
-		else statret = ::lstat(path.c_str(), &sb);
-		if (statret) return; //throw std::runtime_error{"Couldn't stat " + path + ": " + std::string{strerror(errno)}}; // TODO Error handling?
-		if (! depth && ! fn(path, &sb, userd)) return;
-		if (! follow && (sb.st_mode & S_IFMT) == S_IFLNK && ::stat(path.c_str(), &sb)) return; // Re-process links as their destinations
-		if ((sb.st_mode & S_IFMT) == S_IFDIR)
-		{
-			DIR *d = ::opendir(path.c_str());
-			if (! d) return; // TODO
-			struct dirent *child;
-			while ((child = ::readdir(d)))
-			{
-				std::string childname{child->d_name};
-				if (childname != "." && childname != "..") fswalk(path + pathsep + childname, fn, userd, flags);
-			}
-			::closedir(d); // TODO Catch exceptions so that the directory is always closed
+		return [re](const entry &e) { return std::regex_search(e.name.begin(), e.name.end(), re); };
+	}
+
+	dirlist::dirlist(const std::string &dir, const filter &test) : blocks_{}, entries_{}
+	{
+		int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) throw std::runtime_error{"Couldn't open directory " + dir + ": " + std::string{::strerror(errno)}};
+		try { read(fd, test); }
+		catch (...)
+		{
+			::close(fd);
+			throw;
 		}
-		if (depth && ! fn(path, &sb, userd)) return;
+		::close(fd);
 	}
 
-	bool ls_pred(const std::string &path, const struct stat *st, void *arg)
+	dirlist::dirlist(int dirfd, const filter &test) : blocks_{}, entries_{}
 	{
-		((std::unordered_set<std::string> *) arg)->insert(path);
-		return true;
+		read(dirfd, test);
 	}
 
-	std::unordered_set<std::string> recursive_ls(const std::string &base, const std::string &test) // TODO test not currently being considered
+	void dirlist::read(int fd, const filter &test)
 	{
-		std::unordered_set<std::string> ret{};
-		fswalk(base, ls_pred, (void *) &ret, true);
-		return ret;
+		std::unique_ptr<char[]> block{};
+		while (true)
+		{
+			if (! block) block.reset(new char[blocksize]);
+			long len = ::syscall(SYS_getdents64, fd, block.get(), blocksize);
+			if (len < 0)
+			{
+				if (errno == EINTR) continue;
+				throw std::runtime_error{"Couldn't read directory: " + std::string{::strerror(errno)}};
+			}
+			if (len == 0) break;
+			std::size_t prevsize = entries_.size();
+			for (long off = 0; off < len; )
+			{
+				const struct dirent64 *d = reinterpret_cast<const struct dirent64 *>(block.get() + off);
+				off += d->d_reclen;
+				entry e{std::string_view{d->d_name}, static_cast<ino_t>(d->d_ino), d->d_type};
+				if (e.name == "." || e.name == "..") continue;
+				if (test && ! test(e)) continue;
+				entries_.push_back(e);
+			}
+			if (entries_.size() > prevsize) blocks_.push_back(std::move(block)); // Otherwise the block is reused
+		}
 	}
 
-	std::string realpath(const std::string &path)
+	std::unordered_set<std::string> ls(const std::string &dir, const std::string &test)
 	{
-		char *cret = ::realpath(path.c_str(), nullptr);
-		if (! cret) throw std::runtime_error{"Could not determine real path of " + path + ": " + std::string{::strerror(errno)}};
-		std::string ret{cret};
-		::free(cret);
+		dirlist list = test == "" ? dirlist{dir} : dirlist{dir, dirlist::match(std::regex{test})};
+		std::unordered_set<std::string> ret{};
+		ret.reserve(list.size());
+		for (const dirlist::entry &e : list) ret.emplace(e.name);
 		return ret;
 	}
 
-	std::string normalize(const std::string &path)
+	// Runs tasks on a set of threads, each with its own queue.  A worker takes its own newest task first, which keeps
+	// tree traversals depth-first and their working set small, and steals the oldest task of another worker when it
+	// runs out.  Tasks may push more tasks; run returns when all of them are done and rethrows the first exception.
+	class workpool
 	{
-		if (! path.size()) return ".";
-		std::vector<std::string> patharr = strsplit(path, pathsep);
-		std::vector<std::string> ret{};
-		if (patharr[0] == "") ret.push_back("");
-		for (const std::string &elem : patharr)
+	private:
+		struct worker
 		{
-			if (elem == "" || elem == ".") continue;
-			else if (elem == "..")
+			std::mutex lock;
+			std::deque<std::function<void()>> tasks;
+		};
+		std::vector<std::unique_ptr<worker>> workers_;
+		std::atomic<std::size_t> pending_, queued_, next_;
+		std::atomic<bool> failed_;
+		std::mutex waitlock_;
+		std::condition_variable wake_;
+		std::exception_ptr error_;
+		static thread_local const workpool *current_;
+		static thread_local std::size_t self_;
+
+		bool take(std::size_t self, std::function<void()> &task)
+		{
+			for (std::size_t i = 0; i < workers_.size(); i++)
 			{
-				if (! ret.size() || ret.back() == "..") ret.push_back("..");
-				else if (ret.size() == 1 && ret[0] == "") continue;
+				worker &w = *workers_[(self + i) % workers_.size()];
+				std::lock_guard<std::mutex> guard{w.lock};
+				if (w.tasks.empty()) continue;
+				if (i == 0)
+				{
+					task = std::move(w.tasks.back());
+					w.tasks.pop_back();
+				}
+				else
+				{
+					task = std::move(w.tasks.front());
+					w.tasks.pop_front();
+				}
+				queued_--;
+				return true;
+			}
+			return false;
+		}
+
+		void work(std::size_t self)
+		{
+			current_ = this;
+			self_ = self;
+			std::function<void()> task{};
+			while (true)
+			{
+				if (take(self, task))
+				{
+					if (! failed_)
+					{
+						try { task(); }
+						catch (...)
+						{
+							std::lock_guard<std::mutex> guard{waitlock_};
+							if (! error_) error_ = std::current_exception();
+							failed_ = true;
+						}
+					}
+					task = nullptr;
+					if (--pending_ == 0)
+					{
+						std::lock_guard<std::mutex> guard{waitlock_};
+						wake_.notify_all();
+					}
+					continue;
+				}
+				std::unique_lock<std::mutex> guard{waitlock_};
+				wake_.wait(guard, [this]() { return queued_ > 0 || pending_ == 0; });
+				if (pending_ == 0) break;
+			}
+			current_ = nullptr;
+		}
+	public:
+		workpool(std::size_t nthreads = 0) : workers_{}, pending_{0}, queued_{0}, next_{0}, failed_{false}, waitlock_{}, wake_{}, error_{}
+		{
+			if (nthreads == 0) nthreads = std::max(std::thread::hardware_concurrency(), 1u);
+			for (std::size_t i = 0; i < nthreads; i++) workers_.push_back(std::make_unique<worker>());
+		}
+
+		void push(std::function<void()> task)
+		{
+			pending_++;
+			std::size_t target = current_ == this ? self_ : next_++ % workers_.size();
+			{
+				std::lock_guard<std::mutex> guard{workers_[target]->lock};
+				workers_[target]->tasks.push_back(std::move(task));
+			}
+			queued_++;
+			std::lock_guard<std::mutex> guard{waitlock_};
+			wake_.notify_one();
+		}
+
+		void run() // The calling thread works too
+		{
+			std::vector<std::thread> threads{};
+			for (std::size_t i = 1; i < workers_.size(); i++) threads.emplace_back(&workpool::work, this, i);
+			work(0);
+			for (std::thread &t : threads) t.join();
+			if (error_) std::rethrow_exception(error_);
+		}
+	};
+
+	thread_local const workpool *workpool::current_ = nullptr;
+	thread_local std::size_t workpool::self_ = 0;
+
+	using dirhandle = std::unique_ptr<DIR, int (*)(DIR *)>;
+
+	// Opens name relative to the directory dirfd for reading, or returns null
+	dirhandle opendirat(int dirfd, const char *name)
+	{
+		int fd = ::openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) return dirhandle{nullptr, ::closedir};
+		DIR *d = ::fdopendir(fd);
+		if (! d) ::close(fd);
+		return dirhandle{d, ::closedir};
+	}
+
+	// Fills in sb for the entry name of directory dirfd, from its directory entry alone if that's allowed and enough
+	bool fswalk_stat(int dirfd, const char *name, unsigned char type, ino_t ino, int flags, struct stat &sb)
+	{
+		bool follow = flags & fswopt::follow;
+		if ((flags & fswopt::typeonly) && type != DT_UNKNOWN && ! (follow && type == DT_LNK))
+		{
+			sb = {};
+			sb.st_mode = DTTOIF(type);
+			sb.st_ino = ino;
+			return true;
+		}
+		return ::fstatat(dirfd, name, &sb, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0;
+	}
+
+	// The part of visiting a file that doesn't depend on how the walk is scheduled.  Calls back in pre-order and returns
+	// whether the file is a directory to descend into.  sb is left holding what a post-order callback should receive.
+	// Directories that then can't be opened are skipped, with no post-order callback.
+	bool fswalk_enter(int dirfd, const char *name, unsigned char type, ino_t ino, const std::string &path, struct stat &sb, const std::function<bool(const std::string &, const struct stat *, void *)> &fn, void *userd, int flags)
+	{
+		if (! fswalk_stat(dirfd, name, type, ino, flags, sb)) return false; // TODO Error handling?
+		if (! (flags & fswopt::depth) && ! fn(path, &sb, userd)) return false;
+		if (! (flags & fswopt::follow) && S_ISLNK(sb.st_mode) && ::fstatat(dirfd, name, &sb, 0)) return false; // Re-process links as their destinations
+		if (S_ISDIR(sb.st_mode)) return true;
+		if (flags & fswopt::depth) fn(path, &sb, userd);
+		return false;
+	}
+
+	void fswalk_serial(const std::string &path, const std::function<bool(const std::string &, const struct stat *, void *)> &fn, void *userd, int flags)
+	{
+		struct frame
+		{
+			dirhandle dir;
+			std::size_t pathlen;
+			struct stat sb;
+		};
+		std::vector<frame> stack{};
+		std::string cur{path}; // Reused for every path in the walk
+		struct stat sb;
+		auto descend = [&stack, &cur, &sb](int dirfd, const char *name) {
+			dirhandle dir = opendirat(dirfd, name);
+			if (dir) stack.push_back(frame{std::move(dir), cur.size(), sb});
+		};
+		if (fswalk_enter(AT_FDCWD, path.c_str(), DT_UNKNOWN, 0, cur, sb, fn, userd, flags)) descend(AT_FDCWD, path.c_str());
+		while (! stack.empty())
+		{
+			frame &top = stack.back();
+			struct dirent *child = ::readdir(top.dir.get());
+			cur.resize(top.pathlen);
+			if (! child)
+			{
+				sb = top.sb;
+				stack.pop_back();
+				if (flags & fswopt::depth) fn(cur, &sb, userd);
+				continue;
+			}
+			if (child->d_name[0] == '.' && (child->d_name[1] == '\0' || (child->d_name[1] == '.' && child->d_name[2] == '\0'))) continue;
+			cur += pathsep;
+			cur += child->d_name;
+			int dirfd = ::dirfd(top.dir.get());
+			if (fswalk_enter(dirfd, child->d_name, child->d_type, child->d_ino, cur, sb, fn, userd, flags)) descend(dirfd, child->d_name);
+		}
+	}
+
+	void fswalk_parallel(const std::string &path, const std::function<bool(const std::string &, const struct stat *, void *)> &fn, void *userd, int flags)
+	{
+		// Directories stay alive until all of their subdirectories are done, so that the post-order callback can be
+		// made by whichever thread finishes last.  As in rm_tree, each is only opened once its own task starts, relative
+		// to its parent's descriptor, which stays open until then so that paths longer than PATH_MAX still work.
+		struct node
+		{
+			std::string path;
+			std::size_t namepos;
+			struct stat sb;
+			std::shared_ptr<node> parent;
+			dirhandle dir;
+			std::atomic<std::size_t> remaining;
+			node(const std::string &p, std::size_t np, const struct stat &s, const std::shared_ptr<node> &par) : path{p}, namepos{np}, sb(s), parent{par}, dir{nullptr, ::closedir}, remaining{1} { }
+			int parentfd() const { return parent ? ::dirfd(parent->dir.get()) : AT_FDCWD; }
+			const char *name() const { return path.c_str() + namepos; }
+		};
+		workpool pool{};
+		std::function<void(std::shared_ptr<node>)> visit = [&](std::shared_ptr<node> n) {
+			n->dir = opendirat(n->parentfd(), n->name());
+			struct dirent *child;
+			while (n->dir && (child = ::readdir(n->dir.get())))
+			{
+				if (child->d_name[0] == '.' && (child->d_name[1] == '\0' || (child->d_name[1] == '.' && child->d_name[2] == '\0'))) continue;
+				std::string childpath = n->path + pathsep + child->d_name;
+				struct stat sb;
+				if (! fswalk_enter(::dirfd(n->dir.get()), child->d_name, child->d_type, child->d_ino, childpath, sb, fn, userd, flags)) continue;
+				std::shared_ptr<node> sub = std::make_shared<node>(childpath, childpath.size() - ::strlen(child->d_name), sb, n);
+				n->remaining++;
+				pool.push([&visit, sub]() { visit(sub); });
+			}
+			for (std::shared_ptr<node> cur = n; cur && --cur->remaining == 0; cur = cur->parent)
+			{
+				if (! cur->dir) continue;
+				cur->dir.reset();
+				if (flags & fswopt::depth) fn(cur->path, &cur->sb, userd);
+			}
+		};
+		struct stat sb;
+		if (! fswalk_enter(AT_FDCWD, path.c_str(), DT_UNKNOWN, 0, path, sb, fn, userd, flags)) return;
+		std::shared_ptr<node> root = std::make_shared<node>(path, 0, sb, nullptr);
+		pool.push([&visit, root]() { visit(root); });
+		pool.run();
+	}
+
+	void fswalk(const std::string &path, const std::function<bool(const std::string &, const struct stat *, void *)> &fn, void *userd, int flags)
+	{
+		if (flags & fswopt::unordered) fswalk_parallel(path, fn, userd, flags);
+		else fswalk_serial(path, fn, userd, flags);
+	}
+
+	bool rm_tree(const std::string &path, const std::function<void(const std::string &, int)> &progress)
+	{
+		std::mutex reportlock{};
+		std::atomic<bool> ok{true};
+		auto report = [&reportlock, &ok, &progress](const std::string &p, int err) {
+			if (err) ok = false;
+			if (! progress) return;
+			std::lock_guard<std::mutex> guard{reportlock};
+			progress(p, err);
+		};
+		struct stat sb;
+		if (::lstat(path.c_str(), &sb))
+		{
+			if (errno == ENOENT) return true; // Nothing to remove
+			report(path, errno);
+			return false;
+		}
+		if (! S_ISDIR(sb.st_mode))
+		{
+			report(path, ::unlink(path.c_str()) ? errno : 0);
+			return ok;
+		}
+		// A directory's descriptor stays open until everything under it is gone, since its subdirectories are opened
+		// and removed relative to it.  Queued subdirectories hold no descriptor of their own until their task starts.
+		struct node
+		{
+			std::string path;
+			std::size_t namepos;
+			std::shared_ptr<node> parent;
+			int fd;
+			std::atomic<std::size_t> remaining;
+			node(const std::string &p, std::size_t np, const std::shared_ptr<node> &par) : path{p}, namepos{np}, parent{par}, fd{-1}, remaining{1} { }
+			int parentfd() const { return parent ? parent->fd : AT_FDCWD; }
+			const char *name() const { return path.c_str() + namepos; }
+		};
+		workpool pool{};
+		std::function<void(std::shared_ptr<node>)> visit = [&](std::shared_ptr<node> n) {
+			n->fd = ::openat(n->parentfd(), n->name(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (n->fd < 0) report(n->path, errno);
+			else
+			{
+				try
+				{
+					for (const dirlist::entry &e : dirlist{n->fd})
+					{
+						std::string childpath = n->path + pathsep;
+						childpath += e.name;
+						bool isdir = e.type == DT_DIR;
+						struct stat childsb;
+						if (e.type == DT_UNKNOWN) isdir = ! ::fstatat(n->fd, e.name.data(), &childsb, AT_SYMLINK_NOFOLLOW) && S_ISDIR(childsb.st_mode);
+						if (! isdir)
+						{
+							report(childpath, ::unlinkat(n->fd, e.name.data(), 0) ? errno : 0);
+							continue;
+						}
+						std::shared_ptr<node> sub = std::make_shared<node>(childpath, childpath.size() - e.name.size(), n);
+						n->remaining++;
+						pool.push([&visit, sub]() { visit(sub); });
+					}
+				}
+				catch (std::runtime_error &) { report(n->path, errno); }
+			}
+			for (std::shared_ptr<node> cur = n; cur && --cur->remaining == 0; cur = cur->parent)
+			{
+				if (cur->fd >= 0) ::close(cur->fd);
+				report(cur->path, ::unlinkat(cur->parentfd(), cur->name(), AT_REMOVEDIR) ? errno : 0);
+			}
+		};
+		std::shared_ptr<node> root = std::make_shared<node>(path, 0, nullptr);
+		pool.push([&visit, root]() { visit(root); });
+		pool.run();
+		return ok;
+	}
+
+	bool rm_recursive(const std::string &path, const std::function<void(const std::string &, int)> &progress, int flags)
+	{
+		if (! (flags & rmopt::background)) return rm_tree(path, progress);
+		static std::atomic<unsigned int> serial{0};
+		std::string trimmed{path};
+		while (trimmed.size() > 1 && trimmed.back() == pathsep) trimmed.pop_back();
+		std::size_t namepos = trimmed.rfind(pathsep) + 1; // Zero if there's no separator
+		std::string hidden = trimmed.substr(0, namepos) + "." + trimmed.substr(namepos) + ".rm" + std::to_string(::getpid()) + "." + std::to_string(serial++);
+		if (::rename(trimmed.c_str(), hidden.c_str())) return rm_tree(path, progress);
+		std::thread{[hidden, progress]() { rm_tree(hidden, progress); }}.detach();
+		return true;
+	}
+
+	void rm_recursive(const std::string &path)
+	{
+		std::string failpath{};
+		int failerr = 0;
+		rm_recursive(path, [&failpath, &failerr](const std::string &p, int err) {
+			if (err && ! failerr)
+			{
+				failpath = p;
+				failerr = err;
+			}
+		});
+		if (failerr) throw std::runtime_error{"Could not remove " + failpath + ": " + std::string{::strerror(failerr)}};
+	}
+
+	// Closes a descriptor when it goes out of scope
+	struct fdguard
+	{
+		int fd;
+		fdguard(int f) : fd{f} { }
+		fdguard(const fdguard &) = delete;
+		fdguard &operator=(const fdguard &) = delete;
+		~fdguard() { if (fd >= 0) ::close(fd); }
+	};
+
+	const std::size_t cpbufsize = 1 << 20, cpbufalign = 4096;
+
+	using cpbuffer = std::unique_ptr<char, void (*)(void *)>;
+
+	cpbuffer cp_buffer()
+	{
+		cpbuffer ret{static_cast<char *>(::aligned_alloc(cpbufalign, cpbufsize)), ::free};
+		if (! ret) throw std::bad_alloc{};
+		return ret;
+	}
+
+	// Copies len bytes at off in one file to the same place in another, with copy_file_range, or sendfile, or failing
+	// both a read-write loop.  method remembers which is known to work between calls for the same pair of files.
+	// Returns 0 or an errno.  Stops early without error if the source turns out to be shorter.
+	int cp_range(int in, int out, off_t off, off_t len, int &method)
+	{
+		const off_t end = off + len;
+		while (off < end && method == 0)
+		{
+			loff_t inoff = off, outoff = off;
+			ssize_t n = ::copy_file_range(in, &inoff, out, &outoff, end - off, 0);
+			if (n > 0) off += n;
+			else if (n == 0) return 0;
+			else if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) method = 1;
+			else if (errno != EINTR) return errno;
+		}
+		if (off < end && method == 1 && ::lseek(out, off, SEEK_SET) < 0) return errno;
+		while (off < end && method == 1)
+		{
+			off_t inoff = off;
+			ssize_t n = ::sendfile(out, in, &inoff, std::min<off_t>(end - off, 1 << 30));
+			if (n > 0) off += n;
+			else if (n == 0) return 0;
+			else if (errno == EINVAL || errno == ENOSYS) method = 2;
+			else if (errno != EINTR) return errno;
+		}
+		if (off >= end) return 0;
+		cpbuffer buf = cp_buffer();
+		while (off < end)
+		{
+			ssize_t n = ::pread(in, buf.get(), std::min<off_t>(end - off, cpbufsize), off);
+			if (n == 0) return 0;
+			if (n < 0)
+			{
+				if (errno == EINTR) continue;
+				return errno;
+			}
+			for (ssize_t done = 0; done < n; )
+			{
+				ssize_t written = ::pwrite(out, buf.get() + done, n - done, off + done);
+				if (written >= 0) done += written;
+				else if (errno != EINTR) return errno;
+			}
+			off += n;
+		}
+		return 0;
+	}
+
+	// For sources that can't be seeked or sized, like pipes and devices
+	int cp_stream(int in, int out)
+	{
+		cpbuffer buf = cp_buffer();
+		while (true)
+		{
+			ssize_t n = ::read(in, buf.get(), cpbufsize);
+			if (n == 0) return 0;
+			if (n < 0)
+			{
+				if (errno == EINTR) continue;
+				return errno;
+			}
+			for (ssize_t done = 0; done < n; )
+			{
+				ssize_t written = ::write(out, buf.get() + done, n - done);
+				if (written >= 0) done += written;
+				else if (errno != EINTR) return errno;
+			}
+		}
+	}
+
+	void cp_file(const std::string &src, const std::string &dest, int flags)
+	{
+		fdguard in{::open(src.c_str(), O_RDONLY | O_CLOEXEC)};
+		if (in.fd < 0) throw std::runtime_error{"Couldn't open " + src + " for reading: " + std::string{::strerror(errno)}};
+		struct stat st;
+		if (::fstat(in.fd, &st)) throw std::runtime_error{"Couldn't stat file " + src + ": " + std::string{::strerror(errno)}};
+		if (S_ISDIR(st.st_mode)) throw std::runtime_error{"Couldn't copy " + src + ": " + std::string{::strerror(EISDIR)}};
+		fdguard out{::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)};
+		if (out.fd < 0) throw std::runtime_error{"Couldn't open " + dest + " for writing: " + std::string{::strerror(errno)}};
+		int err = 0, method = 0;
+		// Files in /proc and /sys claim to be empty whatever they hold, so an empty file is read like a pipe
+		if (! S_ISREG(st.st_mode) || st.st_size == 0) err = cp_stream(in.fd, out.fd);
+		else if (::ioctl(out.fd, FICLONE, in.fd) == 0) { } // Reflinked, sharing extents and holes with the source
+		else if (flags & cpopt::sparse)
+		{
+			for (off_t data = 0; ! err && data < st.st_size; )
+			{
+				data = ::lseek(in.fd, data, SEEK_DATA);
+				if (data < 0) // ENXIO if only a hole is left; anything else means the filesystem can't tell us
+				{
+					if (errno != ENXIO) err = cp_range(in.fd, out.fd, 0, st.st_size, method);
+					break;
+				}
+				off_t hole = ::lseek(in.fd, data, SEEK_HOLE);
+				if (hole < 0) hole = st.st_size;
+				err = cp_range(in.fd, out.fd, data, hole - data, method);
+				data = hole;
+			}
+			if (! err && ::ftruncate(out.fd, st.st_size)) err = errno;
+		}
+		else
+		{
+			err = cp_range(in.fd, out.fd, 0, st.st_size, method);
+			// Carry on to the end of a file that was still being written to
+			if (! err && (::lseek(in.fd, st.st_size, SEEK_SET) < 0 || ::lseek(out.fd, st.st_size, SEEK_SET) < 0)) err = errno;
+			if (! err) err = cp_stream(in.fd, out.fd);
+		}
+		if (! err && (flags & cpopt::mode) && ::fchmod(out.fd, st.st_mode & 07777)) err = errno;
+		struct timespec times[2] = {st.st_atim, st.st_mtim};
+		if (! err && (flags & cpopt::times) && ::futimens(out.fd, times)) err = errno;
+		if (err) throw std::runtime_error{"Couldn't copy " + src + " to " + dest + ": " + std::string{::strerror(err)}};
+	}
+
+	void cp(const std::string &src, const std::string &dest, int flags)
+	{
+		struct stat st;
+		if (! (flags & cpopt::recursive) || ::stat(src.c_str(), &st) || ! S_ISDIR(st.st_mode))
+		{
+			cp_file(src, dest, flags);
+			return;
+		}
+		// Directories are walked in this thread and their files queued, then copied in parallel.  Directories keep the
+		// default permissions while they're filled and get their source's at the end, innermost first.
+		workpool pool{};
+		std::vector<std::pair<std::string, struct stat>> dirs{};
+		fswalk(src, [&src, &dest, &st, &dirs, &pool, flags](const std::string &path, const struct stat *sb, void *) {
+			std::string target = dest + path.substr(src.size());
+			if (path.size() == src.size()) sb = &st; // src itself may be a link to a directory
+			if (S_ISDIR(sb->st_mode))
+			{
+				mkdir(target, 0777, true);
+				dirs.emplace_back(target, *sb);
+				return true;
+			}
+			if (S_ISLNK(sb->st_mode))
+			{
+				std::string link{};
+				link.resize(sb->st_size);
+				ssize_t len = ::readlink(path.c_str(), &link[0], link.size());
+				if (len < 0) throw std::runtime_error{"Couldn't read link " + path + ": " + std::string{::strerror(errno)}};
+				link.resize(len);
+				if (::unlink(target.c_str()) && errno != ENOENT) throw std::runtime_error{"Couldn't replace " + target + ": " + std::string{::strerror(errno)}};
+				if (::symlink(link.c_str(), target.c_str())) throw std::runtime_error{"Couldn't create link " + target + ": " + std::string{::strerror(errno)}};
+			}
+			else if (S_ISREG(sb->st_mode)) pool.push([path, target, flags]() { cp_file(path, target, flags); });
+			return false; // Don't descend into links
+		});
+		pool.run();
+		for (auto dir = dirs.rbegin(); dir != dirs.rend(); dir++)
+		{
+			if ((flags & cpopt::mode) && ::chmod(dir->first.c_str(), dir->second.st_mode & 07777)) throw std::runtime_error{"Couldn't set mode of " + dir->first + ": " + std::string{::strerror(errno)}};
+			struct timespec times[2] = {dir->second.st_atim, dir->second.st_mtim};
+			if ((flags & cpopt::times) && ::utimensat(AT_FDCWD, dir->first.c_str(), times, 0)) throw std::runtime_error{"Couldn't set times of " + dir->first + ": " + std::string{::strerror(errno)}};
+		}
+	}
+
+	std::unordered_set<std::string> recursive_ls(const std::string &base, const std::string &test)
+	{
+		std::unordered_set<std::string> ret{};
+		std::regex testre{test};
+		fswalk(base, [&ret, &testre, &test](const std::string &path, const struct stat *st, void *) {
+			if (test == "" || std::regex_search(path.begin() + (path.rfind(pathsep) + 1), path.end(), testre)) ret.insert(path);
+			return true;
+		}, nullptr, fswopt::follow | fswopt::typeonly);
+		return ret;
+	}
+
+	std::string realpath(const std::string &path)
+	{
+		char *cret = ::realpath(path.c_str(), nullptr);
+		if (! cret) throw std::runtime_error{"Could not determine real path of " + path + ": " + std::string{::strerror(errno)}};
+		std::string ret{cret};
+		::free(cret);
+		return ret;
+	}
+
+	std::string normalize(const std::string &path)
+	{
+		if (! path.size()) return ".";
+		std::vector<std::string> patharr = strsplit(path, pathsep);
+		std::vector<std::string> ret{};
+		if (patharr[0] == "") ret.push_back("");
+		for (const std::string &elem : patharr)
+		{
+			if (elem == "" || elem == ".") continue;
+			else if (elem == "..")
+			{
+				if (! ret.size() || ret.back() == "..") ret.push_back("..");
+				else if (ret.size() == 1 && ret[0] == "") continue;
 				else ret.pop_back();
 			}
 			else ret.push_back(elem);
@@ -465,46 +1448,184 @@ namespace util
 		return ret;
 	}
 
-	std::string ext2mime(const std::string &path)
+	std::string_view mime_lookup(std::string_view ext)
 	{
-		std::string::size_type idx = path.rfind(".");
-		if (idx == path.npos) return "";
-		std::string ext = utf8lower(path.substr(idx + 1));
-		if (! mime_types.count(ext)) return "";
-		return mime_types.at(ext);
+		char lower[mime_ext_maxlen()];
+		if (ext.empty() || ext.size() > sizeof(lower)) return "";
+		for (std::size_t i = 0; i < ext.size(); i++) lower[i] = ext[i] >= 'A' && ext[i] <= 'Z' ? ext[i] + ('a' - 'A') : ext[i];
+		std::string_view key{lower, ext.size()};
+		auto iter = std::lower_bound(std::begin(mime_types), std::end(mime_types), key, [](const std::pair<std::string_view, std::string_view> &type, std::string_view k) { return type.first < k; });
+		if (iter == std::end(mime_types) || iter->first != key) return "";
+		return iter->second;
 	}
 
-	std::string mimetype(const std::string &path, const std::string &data)
+	std::string_view ext2mime(std::string_view path)
 	{
-		std::string extmime = ext2mime(path);
-		if (extmime != "") return extmime;
-		magic_t myt = ::magic_open(MAGIC_ERROR | MAGIC_MIME_TYPE);
-		::magic_load(myt, nullptr);
-		const char *type = ::magic_buffer(myt, &data[0], data.size());
-		if (type == nullptr)
+		std::string_view::size_type sep = path.rfind(pathsep);
+		std::string_view name = sep == path.npos ? path : path.substr(sep + 1);
+		std::string_view::size_type last = name.rfind('.');
+		if (last == name.npos) return "";
+		if (last > 0)
 		{
-			::magic_close(myt);
-			return "application/octet-stream";
+			std::string_view::size_type prev = name.rfind('.', last - 1);
+			if (prev != name.npos)
+			{
+				std::string_view compound = mime_lookup(name.substr(prev + 1));
+				if (! compound.empty()) return compound;
+			}
 		}
-		std::string ret{type};
-		::magic_close(myt);
-		return ret;
+		return mime_lookup(name.substr(last + 1));
 	}
 
-	std::string mimetype(const std::string &path)
+	std::string ext2mime(const std::string &path)
+	{
+		return std::string{ext2mime(std::string_view{path})};
+	}
+
+	std::string ext2mime(const char *path)
+	{
+		return std::string{ext2mime(std::string_view{path})};
+	}
+
+	// Loading the magic database is slow and handles can't be shared between threads, so each thread loads its own
+	// once and keeps it until it exits.  Returns null if the database couldn't be loaded.
+	magic_t magic_handle()
 	{
-		std::string extmime = ext2mime(path);
-		if (extmime != "") return extmime;
-		magic_t myt = ::magic_open(MAGIC_ERROR | MAGIC_MIME_TYPE);
-		::magic_load(myt, nullptr);
-		const char *type = ::magic_file(myt, path.c_str());
-		if (type == nullptr)
+		struct guard
 		{
-			::magic_close(myt);
-			return "application/octet-stream";
+			magic_t cookie;
+			guard() : cookie{::magic_open(MAGIC_ERROR | MAGIC_MIME_TYPE)}
+			{
+				if (cookie && ::magic_load(cookie, nullptr))
+				{
+					::magic_close(cookie);
+					cookie = nullptr;
+				}
+			}
+			~guard() { if (cookie) ::magic_close(cookie); }
+		};
+		thread_local guard handle{};
+		return handle.cookie;
+	}
+
+	class mimecache
+	{
+	private:
+		struct key
+		{
+			dev_t dev;
+			ino_t ino;
+			off_t size;
+			struct timespec mtime;
+			bool operator==(const key &other) const
+			{
+				return dev == other.dev && ino == other.ino && size == other.size && mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec;
+			}
+		};
+		struct keyhash
+		{
+			std::size_t operator()(const key &k) const
+			{
+				std::size_t ret = std::hash<ino_t>{}(k.ino);
+				for (std::size_t part : {static_cast<std::size_t>(k.dev), static_cast<std::size_t>(k.size), static_cast<std::size_t>(k.mtime.tv_sec), static_cast<std::size_t>(k.mtime.tv_nsec)})
+					ret ^= part + 0x9e3779b97f4a7c15 + (ret << 6) + (ret >> 2);
+				return ret;
+			}
+		};
+		using entry = std::pair<key, std::string>;
+		std::mutex lock_;
+		std::size_t capacity_;
+		std::list<entry> order_; // Most recently used at the front
+		std::unordered_map<key, std::list<entry>::iterator, keyhash> index_;
+		std::size_t hits_, misses_;
+		static key mkkey(const struct stat &st) { return key{st.st_dev, st.st_ino, st.st_size, st.st_mtim}; }
+		void trim()
+		{
+			while (order_.size() > capacity_)
+			{
+				index_.erase(order_.back().first);
+				order_.pop_back();
+			}
 		}
-		std::string ret{type};
-		::magic_close(myt);
+	public:
+		mimecache(std::size_t capacity) : lock_{}, capacity_{capacity}, order_{}, index_{}, hits_{0}, misses_{0} { }
+		bool get(const struct stat &st, std::string &out)
+		{
+			std::lock_guard<std::mutex> guard{lock_};
+			auto iter = index_.find(mkkey(st));
+			if (iter == index_.end())
+			{
+				misses_++;
+				return false;
+			}
+			hits_++;
+			order_.splice(order_.begin(), order_, iter->second);
+			out = iter->second->second;
+			return true;
+		}
+		void put(const struct stat &st, const std::string &type)
+		{
+			std::lock_guard<std::mutex> guard{lock_};
+			if (! capacity_) return;
+			key k = mkkey(st);
+			auto iter = index_.find(k);
+			if (iter != index_.end()) order_.erase(iter->second);
+			order_.emplace_front(k, type);
+			index_[k] = order_.begin();
+			trim();
+		}
+		void resize(std::size_t capacity)
+		{
+			std::lock_guard<std::mutex> guard{lock_};
+			capacity_ = capacity;
+			trim();
+		}
+		mimecache_stats stats()
+		{
+			std::lock_guard<std::mutex> guard{lock_};
+			return mimecache_stats{hits_, misses_, order_.size()};
+		}
+	};
+
+	mimecache &mimetype_cache()
+	{
+		static mimecache cache{4096};
+		return cache;
+	}
+
+	mimecache_stats mimetype_cache_stats()
+	{
+		return mimetype_cache().stats();
+	}
+
+	void mimetype_cache_size(std::size_t entries)
+	{
+		mimetype_cache().resize(entries);
+	}
+
+	std::string mimetype(const std::string &path, const std::string &data)
+	{
+		std::string_view extmime = ext2mime(std::string_view{path});
+		if (! extmime.empty()) return std::string{extmime};
+		magic_t myt = magic_handle();
+		const char *type = myt ? ::magic_buffer(myt, &data[0], data.size()) : nullptr;
+		if (type == nullptr) return "application/octet-stream";
+		return std::string{type};
+	}
+
+	std::string mimetype(const std::string &path)
+	{
+		std::string_view extmime = ext2mime(std::string_view{path});
+		if (! extmime.empty()) return std::string{extmime};
+		struct stat st;
+		bool cacheable = ::lstat(path.c_str(), &st) == 0; // libmagic doesn't follow symlinks by default either
+		std::string ret{};
+		if (cacheable && mimetype_cache().get(st, ret)) return ret;
+		magic_t myt = magic_handle();
+		const char *type = myt ? ::magic_file(myt, path.c_str()) : nullptr;
+		if (type == nullptr) return "application/octet-stream";
+		ret = type;
+		if (cacheable) mimetype_cache().put(st, ret);
 		return ret;
 	}
 
@@ -591,7 +1712,109 @@ namespace util
 	{
 		if (dir == std::ios_base::beg) return seekpos(off, which);
 		if (dir == std::ios_base::end) return seekpos(size_ + off, which);
-		return seekpos(pos_ + gptr() - eback(), which);
+		return seekpos(pos_ + (gptr() - eback()) + off, which);
+	}
+
+	fdrangebuf::fdrangebuf(int fd, off_t start, off_t size, size_t blocksize, bool readahead) : fd_{fd}, start_{start}, size_{size}, pos_{0}, nextpos_{0}, blocksize_{blocksize}, readahead_{readahead}, buf_(blocksize), next_(readahead ? blocksize : 0), pending_{}
+	{
+		setg(&buf_[0], &buf_[0], &buf_[0]);
+	}
+
+	// Reads the block at pos in the range, returning its length or a negated errno.  Runs in the background for
+	// read-ahead, so it mustn't touch anything but the descriptor and range.
+	ssize_t fdrangebuf::read(char *dest, off_t pos) const
+	{
+		size_t len = std::min<off_t>(blocksize_, size_ - pos), done = 0;
+		while (done < len)
+		{
+			ssize_t n = ::pread(fd_, dest + done, len - done, start_ + pos + done);
+			if (n == 0) break;
+			if (n > 0) done += n;
+			else if (errno != EINTR) return -errno;
+		}
+		return done;
+	}
+
+	void fdrangebuf::fill(off_t pos)
+	{
+		ssize_t len;
+		if (pending_.valid() && (len = pending_.get(), nextpos_ == pos)) std::swap(buf_, next_);
+		else len = read(&buf_[0], pos);
+		if (len < 0)
+		{
+			setg(&buf_[0], &buf_[0], &buf_[0]);
+			throw std::runtime_error{"Couldn't read range: " + std::string{::strerror(-len)}};
+		}
+		pos_ = pos;
+		setg(&buf_[0], &buf_[0], &buf_[0] + len);
+		if (readahead_ && len > 0 && pos + len < size_)
+		{
+			nextpos_ = pos + len;
+			char *dest = &next_[0];
+			pending_ = std::async(std::launch::async, [this, dest, next = nextpos_]() { return read(dest, next); });
+		}
+	}
+
+	std::streambuf::int_type fdrangebuf::underflow()
+	{
+		if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+		off_t next = pos_ + (egptr() - eback());
+		if (next >= size_) return traits_type::eof();
+		fill(next);
+		if (gptr() == egptr()) return traits_type::eof();
+		return traits_type::to_int_type(*gptr());
+	}
+
+	std::streambuf::pos_type fdrangebuf::seekpos(pos_type target, std::ios_base::openmode which)
+	{
+		off_t to = std::max<off_t>(0, std::min<off_t>(target, size_));
+		if (to >= pos_ && to < pos_ + (egptr() - eback())) setg(eback(), eback() + (to - pos_), egptr());
+		else fill(to);
+		return pos_ + (gptr() - eback());
+	}
+
+	std::streambuf::pos_type fdrangebuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+	{
+		if (dir == std::ios_base::beg) return seekpos(off, which);
+		if (dir == std::ios_base::end) return seekpos(size_ + off, which);
+		return seekpos(pos_ + (gptr() - eback()) + off, which);
+	}
+
+	std::streambuf::int_type iconvbuf::underflow()
+	{
+		if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+		out_.clear();
+		while (out_.empty() && ! done_)
+		{
+			std::size_t have = in_.size();
+			in_.resize(have + blocksize);
+			src_.read(&in_[have], blocksize);
+			in_.resize(have + src_.gcount());
+			if (src_.gcount() == 0)
+			{
+				done_ = true;
+				if (! in_.empty()) throw std::runtime_error{"Couldn't convert stream: " + std::string{::strerror(EINVAL)}};
+				conv_.finish(out_);
+			}
+			else in_.erase(0, conv_.partial(in_, out_));
+		}
+		if (out_.empty()) return traits_type::eof();
+		setg(&out_[0], &out_[0], &out_[0] + out_.size());
+		return traits_type::to_int_type(*gptr());
+	}
+
+	std::streambuf::pos_type membuf::seekpos(pos_type pos, std::ios_base::openmode mode)
+	{
+		if (! (mode & std::ios_base::in) || pos < 0 || pos > egptr() - eback()) return pos_type(off_type(-1));
+		setg(eback(), eback() + pos, egptr());
+		return pos;
+	}
+
+	std::streambuf::pos_type membuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode mode)
+	{
+		if (dir == std::ios_base::cur) off += gptr() - eback();
+		else if (dir == std::ios_base::end) off += egptr() - eback();
+		return seekpos(off, mode);
 	}
 
 	std::streampos streamsize(std::istream &stream)
@@ -604,58 +1827,136 @@ namespace util
 		return ret;
 	}
 
+	// Appends the expansion of the named or numeric entity to out, or returns false if it isn't one we recognize
+	bool decode_entity(std::string_view name, std::string &out)
+	{
+		auto iter = std::lower_bound(std::begin(htmlent), std::end(htmlent), name, [](const std::pair<std::string_view, std::string_view> &ent, std::string_view n) { return ent.first < n; });
+		if (iter != std::end(htmlent) && iter->first == name)
+		{
+			out += iter->second;
+			return true;
+		}
+		if (name.size() < 2 || name[0] != '#') return false;
+		int base = 10;
+		name.remove_prefix(1);
+		if (name[0] == 'x' || name[0] == 'X')
+		{
+			base = 16;
+			name.remove_prefix(1);
+		}
+		uint32_t codepoint;
+		std::from_chars_result res = std::from_chars(name.data(), name.data() + name.size(), codepoint, base);
+		if (name.empty() || res.ec != std::errc{} || res.ptr != name.data() + name.size()) return false;
+		if (codepoint > 0x10ffff || (codepoint >= 0xd800 && codepoint <= 0xdfff)) return false;
+		codepoint2utf8(codepoint, out);
+		return true;
+	}
+
 	std::string from_htmlent(const std::string &str)
 	{
-		std::ostringstream ret{}, curent{};
-		bool entproc = false;
-		std::string::const_iterator iter = str.cbegin();
-		while (iter != str.cend())
+		std::string ret{};
+		ret.reserve(str.size());
+		std::size_t pos = 0;
+		while (pos < str.size())
 		{
-			if (entproc && *iter == ';')
-			{
-				std::string curstr = curent.str();
-				if (htmlent.count(curstr)) ret << htmlent.at(curstr);
-				else if (curstr.size() > 2 && curstr.substr(0, 2) == "#x") ret << codepoint2utf8(std::stol(curstr.substr(2), 0, 16));
-				else if (curstr.size() > 1 && curstr[0] == '#') ret << codepoint2utf8(s2t<long>(curstr.substr(1)));
-				else ret << '&' << curstr << ';';
-				entproc = false;
-				curent.str("");
-				curent.clear();
-			}
-			else if (entproc && *iter == '&')
+			const char *amp = static_cast<const char *>(::memchr(str.data() + pos, '&', str.size() - pos));
+			if (! amp)
 			{
-				ret << '&' << curent.str();
-				curent.str("");
-				curent.clear();
+				ret.append(str, pos, std::string::npos);
+				break;
 			}
-			else if (entproc && (*iter < 32 || *iter > 126))
+			std::size_t start = amp - str.data(), end = start + 1;
+			ret.append(str, pos, start - pos);
+			while (end < str.size() && str[end] != ';' && str[end] != '&' && str[end] >= 32 && str[end] <= 126) end++;
+			if (end < str.size() && str[end] == ';' && decode_entity(std::string_view{str}.substr(start + 1, end - start - 1), ret)) pos = end + 1;
+			else // Not an entity, so copy it through and let whatever stopped it be handled as ordinary text
 			{
-				ret << '&' << curent.str() << *iter;
-				entproc = false;
-				curent.str("");
-				curent.clear();
+				ret.append(str, start, end - start);
+				pos = end;
 			}
-			else if (entproc) curent << *iter;
-			else if (*iter == '&') entproc = true;
-			else ret << *iter;
-			iter++;
 		}
-		if (entproc) ret << '&' << curent.str();
-		return ret.str();
+		return ret;
 	}
 
-	std::string to_htmlent(const std::string &str)
+	constexpr std::string_view basic_ent[] = {"", "&quot;", "&amp;", "&apos;", "&lt;", "&gt;"};
+
+	// For each escaping context, the index into basic_ent of each byte's replacement, or zero to leave it alone
+	constexpr std::array<std::array<uint8_t, 256>, 4> basic_ent_table()
 	{
-		static std::map<char, std::string> basic_ent{{'"', "quot"}, {'&', "amp"}, {'\'', "apos"}, {'<', "lt"}, {'>', "gt"}};
-		std::ostringstream ret{};
-		for (const char &c : str)
+		std::array<std::array<uint8_t, 256>, 4> ret{};
+		for (int ctx = 0; ctx < 4; ctx++)
 		{
-			if (basic_ent.count(c)) ret << "&" << basic_ent[c] << ";";
-			//else if (c <= L'~') ret << c; // What about control characters?
-			//else ret << L"&#" << static_cast<wint_t>(c) << L";";
-			else ret << c;
+			ret[ctx]['&'] = ctx ? 2 : 0;
+			if (ctx & entctx::text) { ret[ctx]['<'] = 4; ret[ctx]['>'] = 5; }
+			if (ctx & entctx::attr) { ret[ctx]['"'] = 1; ret[ctx]['\''] = 3; }
 		}
-		return ret.str();
+		return ret;
+	}
+
+	constexpr std::array<std::array<uint8_t, 256>, 4> basic_ent_index = basic_ent_table();
+
+	// Returns the position of the first byte at or after pos that needs escaping in context ctx, or len if none does
+	std::size_t next_htmlent(const char *s, std::size_t pos, std::size_t len, int ctx)
+	{
+		const std::array<uint8_t, 256> &table = basic_ent_index[ctx];
+#ifdef __AVX2__
+		const __m256i amp32 = _mm256_set1_epi8('&'), lt32 = _mm256_set1_epi8('<'), gt32 = _mm256_set1_epi8('>'), quot32 = _mm256_set1_epi8('"'), apos32 = _mm256_set1_epi8('\'');
+		for (; pos + 32 <= len; pos += 32)
+		{
+			__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + pos));
+			__m256i hit = _mm256_cmpeq_epi8(block, amp32);
+			if (ctx & entctx::text) hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(block, lt32), _mm256_cmpeq_epi8(block, gt32)));
+			if (ctx & entctx::attr) hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(block, quot32), _mm256_cmpeq_epi8(block, apos32)));
+			if (uint32_t mask = _mm256_movemask_epi8(hit)) return pos + __builtin_ctz(mask);
+		}
+#endif
+#ifdef __SSE2__
+		const __m128i amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), quot = _mm_set1_epi8('"'), apos = _mm_set1_epi8('\'');
+		for (; pos + 16 <= len; pos += 16)
+		{
+			__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + pos));
+			__m128i hit = _mm_cmpeq_epi8(block, amp);
+			if (ctx & entctx::text) hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(block, lt), _mm_cmpeq_epi8(block, gt)));
+			if (ctx & entctx::attr) hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(block, quot), _mm_cmpeq_epi8(block, apos)));
+			if (int mask = _mm_movemask_epi8(hit)) return pos + __builtin_ctz(mask);
+		}
+#endif
+		for (; pos < len; pos++) if (table[static_cast<uint8_t>(s[pos])]) return pos;
+		return len;
+	}
+
+	void to_htmlent(std::string_view str, std::string &out, int ctx)
+	{
+		ctx &= entctx::all;
+		if (! ctx)
+		{
+			out += str;
+			return;
+		}
+		const std::array<uint8_t, 256> &table = basic_ent_index[ctx];
+		std::size_t extra = 0;
+		for (std::size_t pos = next_htmlent(str.data(), 0, str.size(), ctx); pos < str.size(); pos = next_htmlent(str.data(), pos + 1, str.size(), ctx))
+			extra += basic_ent[table[static_cast<uint8_t>(str[pos])]].size() - 1;
+		std::size_t w = out.size(), last = 0;
+		out.resize(w + str.size() + extra);
+		char *dest = &out[0];
+		for (std::size_t pos = next_htmlent(str.data(), 0, str.size(), ctx); pos < str.size(); pos = next_htmlent(str.data(), last, str.size(), ctx))
+		{
+			::memcpy(dest + w, str.data() + last, pos - last);
+			w += pos - last;
+			std::string_view ent = basic_ent[table[static_cast<uint8_t>(str[pos])]];
+			::memcpy(dest + w, ent.data(), ent.size());
+			w += ent.size();
+			last = pos + 1;
+		}
+		::memcpy(dest + w, str.data() + last, str.size() - last);
+	}
+
+	std::string to_htmlent(const std::string &str, int ctx)
+	{
+		std::string ret{};
+		to_htmlent(str, ret, ctx);
+		return ret;
 	}
 
 	uint32_t str2ip(const std::string &in) // NOTE Endian-specific!  Not portable between architectures
@@ -683,79 +1984,403 @@ namespace util
 		return ret.str();
 	}
 
-	void *mmap_guard::open(const std::string &fname)
+	void mmap_guard::advise()
+	{
+		// Advice is only a hint, so failures (hugepages on a filesystem without them, say) are ignored
+		if (! map) return;
+		if (! (flags & (mmapopt::sequential | mmapopt::random | mmapopt::willneed | mmapopt::hugepage))) ::madvise(mapstart(), fsize + skew, MADV_RANDOM);
+		if (flags & mmapopt::sequential) ::madvise(mapstart(), fsize + skew, MADV_SEQUENTIAL);
+		if (flags & mmapopt::random) ::madvise(mapstart(), fsize + skew, MADV_RANDOM);
+		if (flags & mmapopt::willneed) ::madvise(mapstart(), fsize + skew, MADV_WILLNEED);
+		if (flags & mmapopt::hugepage) ::madvise(mapstart(), fsize + skew, MADV_HUGEPAGE);
+	}
+
+	void *mmap_guard::open(const std::string &fname, int flags, off_t offset, size_t len)
 	{
 		close();
-		struct stat st;
-		if (::stat(fname.c_str(), &st)) throw std::runtime_error{"Could not stat " + fname + ": " + std::string{::strerror(errno)}};
-		fsize = st.st_size;
-		fd = ::open(fname.c_str(), O_RDONLY);
+		if (flags & mmapopt::create) flags |= mmapopt::write;
+		this->flags = flags;
+		this->offset = offset;
+		skew = offset % ::sysconf(_SC_PAGESIZE);
+		fd = ::open(fname.c_str(), ((flags & mmapopt::write) ? O_RDWR : O_RDONLY) | ((flags & mmapopt::create) ? O_CREAT : 0) | O_CLOEXEC, 0666);
 		if (fd < 0) throw std::runtime_error{"Could not open " + fname + ": " + std::string{::strerror(errno)}};
-		map = ::mmap(nullptr, fsize, PROT_READ, MAP_SHARED, fd, 0);
-		if (map == MAP_FAILED)
+		struct stat st;
+		if (::fstat(fd, &st))
 		{
-			::close(fd); // Ignore errors?
-			map = nullptr;
-			throw std::runtime_error{"Could not mmap " + fname + ": " + std::string{::strerror(errno)}};
+			int err = errno;
+			close();
+			throw std::runtime_error{"Could not stat " + fname + ": " + std::string{::strerror(err)}};
 		}
-		if (madvise(map, fsize, MADV_RANDOM) != 0) throw std::runtime_error{"madvise failed: " + std::string{::strerror(errno)}};
+		size_t avail = st.st_size > offset ? st.st_size - offset : 0;
+		if (len == 0 || (len > avail && ! (flags & mmapopt::write))) len = avail;
+		try { grow(len); }
+		catch (std::runtime_error &e)
+		{
+			close();
+			throw std::runtime_error{"Could not mmap " + fname + ": " + e.what()};
+		}
+		return map;
+	}
+
+	void *mmap_guard::grow(size_t len)
+	{
+		if (len <= fsize) return map;
+		struct stat st;
+		if (::fstat(fd, &st)) throw std::runtime_error{"Could not stat mapped file: " + std::string{::strerror(errno)}};
+		bool extend = static_cast<size_t>(st.st_size) < offset + len;
+		if (extend && ! (flags & mmapopt::write)) throw std::runtime_error{"Can't grow a read-only map past the end of its file"};
+		if (extend && ::ftruncate(fd, offset + len)) throw std::runtime_error{"Could not extend mapped file: " + std::string{::strerror(errno)}};
+		void *start;
+		if (map) start = ::mremap(mapstart(), fsize + skew, len + skew, MREMAP_MAYMOVE);
+		else start = ::mmap(nullptr, len + skew, (flags & mmapopt::write) ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED | ((flags & mmapopt::populate) ? MAP_POPULATE : 0), fd, offset - skew);
+		if (start == MAP_FAILED) throw std::runtime_error{std::string{::strerror(errno)}};
+		map = static_cast<char *>(start) + skew;
+		fsize = len;
+		advise();
 		return map;
 	}
 
+	void mmap_guard::sync(bool wait)
+	{
+		if (map && ::msync(mapstart(), fsize + skew, wait ? MS_SYNC : MS_ASYNC)) throw std::runtime_error{"Msync failed: " + std::string{::strerror(errno)}};
+	}
+
 	void mmap_guard::close()
 	{
-		if (! map) return;
-		if (::munmap(map, fsize)) throw std::runtime_error{"Munmap failed: " + std::string{::strerror(errno)}};
-		if (::close(fd)) throw std::runtime_error{"Close failed: " + std::string{::strerror(errno)}};
+		void *start = map ? mapstart() : nullptr;
+		size_t len = fsize + skew;
+		int oldfd = fd;
+		map = nullptr;
+		fsize = 0;
+		fd = -1;
+		if (start && ::munmap(start, len)) throw std::runtime_error{"Munmap failed: " + std::string{::strerror(errno)}};
+		if (oldfd >= 0 && ::close(oldfd)) throw std::runtime_error{"Close failed: " + std::string{::strerror(errno)}};
 	}
 
-	int system(const std::string &bin, const std::vector<std::string> &args)
+	mmap_guard &mmap_guard::operator=(mmap_guard &&orig)
+	{
+		if (this == &orig) return *this;
+		close();
+		fd = orig.fd;
+		fsize = orig.fsize;
+		map = orig.map;
+		flags = orig.flags;
+		offset = orig.offset;
+		skew = orig.skew;
+		orig.map = nullptr;
+		orig.fd = -1;
+		orig.fsize = 0;
+		return *this;
+	}
+
+	int waitchild(pid_t pid)
 	{
-		std::vector<const char *> cargs{};
-		cargs.push_back(bin.c_str());
-		for (const std::string &arg : args) cargs.push_back(arg.c_str());
-		cargs.push_back(0);
-		pid_t pid = fork();
-		if (pid == -1) throw std::runtime_error{"Failed to fork"};
-		if (pid == 0) execvp(bin.c_str(), (char **) &cargs[0]);
 		int ret;
-		wait(&ret);
+		while (::waitpid(pid, &ret, 0) < 0) if (errno != EINTR) throw std::runtime_error{"Failed to wait for child: " + std::string{::strerror(errno)}};
 		return ret;
 	}
 
-	std::pair<int, std::string> sysio(const std::string &bin, const std::vector<std::string> &args, const std::string &in, bool readout)
+	// Waits for a child until deadline and then kills it, returning its wait status either way
+	int waitchild(pid_t pid, std::chrono::steady_clock::time_point deadline)
 	{
-		std::vector<const char *>cargs{};
+		while (true)
+		{
+			int status;
+			pid_t done = ::waitpid(pid, &status, WNOHANG);
+			if (done == pid) return status;
+			if (done < 0 && errno != EINTR) throw std::runtime_error{"Failed to wait for child: " + std::string{::strerror(errno)}};
+			auto left = deadline - std::chrono::steady_clock::now();
+			if (left.count() <= 0) break;
+			std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(left, std::chrono::milliseconds{5}));
+		}
+		::kill(pid, SIGKILL);
+		return waitchild(pid);
+	}
+
+	// Starts bin with the given descriptors, where they're not negative, as its standard streams.  glibc's posix_spawnp
+	// shares the parent's memory until the exec and reports exec failures back through its return value.
+	pid_t spawn(const std::string &bin, const std::vector<std::string> &args, int in, int out, int err, const sigset_t *mask = nullptr)
+	{
+		std::vector<const char *> cargs{};
 		cargs.push_back(bin.c_str());
 		for (const std::string &arg : args) cargs.push_back(arg.c_str());
 		cargs.push_back(0);
-		int infd[2], outfd[2];
-		if (pipe(infd) || pipe(outfd)) throw std::runtime_error{"Failed to open pipe: " + std::string{strerror(errno)}};
-		pid_t pid = fork();
-		if (pid == -1) throw std::runtime_error{"Failed to fork: " + std::string{strerror(errno)}}; // TODO Close pipes
-		if (pid == 0)
-		{
-			dup2(infd[0], 0); dup2(outfd[1], 1);
-			close(infd[0]); close(infd[1]);
-			close(outfd[0]); close(outfd[1]);
-			if (! readout) close(1);
-			execvp(bin.c_str(), (char **) &cargs[0]);
-		}
-		close(infd[0]); close(outfd[1]);
-		std::size_t cnt = 0;
-		while (cnt < in.size()) cnt += write(infd[1], &in[cnt], in.size() - cnt);
-		close(infd[1]);
-		int ret; wait(&ret);
-		std::string out, buf;
-		buf.resize(256);
-		while (true)
+		posix_spawn_file_actions_t actions;
+		posix_spawnattr_t attr;
+		::posix_spawn_file_actions_init(&actions);
+		::posix_spawnattr_init(&attr);
+		if (in >= 0) ::posix_spawn_file_actions_adddup2(&actions, in, 0);
+		if (out >= 0) ::posix_spawn_file_actions_adddup2(&actions, out, 1);
+		if (err >= 0) ::posix_spawn_file_actions_adddup2(&actions, err, 2);
+		if (mask)
+		{
+			::posix_spawnattr_setsigmask(&attr, mask);
+			::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+		}
+		pid_t pid;
+		int fail = ::posix_spawnp(&pid, bin.c_str(), &actions, &attr, (char **) &cargs[0], environ);
+		::posix_spawn_file_actions_destroy(&actions);
+		::posix_spawnattr_destroy(&attr);
+		if (fail) throw std::runtime_error{"Failed to run " + bin + ": " + std::string{::strerror(fail)}};
+		return pid;
+	}
+
+	int system(const std::string &bin, const std::vector<std::string> &args)
+	{
+		return waitchild(spawn(bin, args, -1, -1, -1));
+	}
+
+	// Blocks SIGPIPE in this thread while writing to a child that may have stopped reading, so that the write fails with
+	// EPIPE instead, and swallows any SIGPIPE that was raised on the way out.
+	class sigpipe_guard
+	{
+	private:
+		sigset_t old_;
+		bool pending_; // One was already pending before, and so isn't ours to swallow
+	public:
+		sigpipe_guard()
+		{
+			sigset_t pipeset, waiting;
+			sigemptyset(&pipeset);
+			sigaddset(&pipeset, SIGPIPE);
+			sigpending(&waiting);
+			pending_ = sigismember(&waiting, SIGPIPE);
+			pthread_sigmask(SIG_BLOCK, &pipeset, &old_);
+		}
+		sigpipe_guard(const sigpipe_guard &orig) = delete;
+		~sigpipe_guard()
+		{
+			sigset_t pipeset, waiting;
+			sigemptyset(&pipeset);
+			sigaddset(&pipeset, SIGPIPE);
+			sigpending(&waiting);
+			if (! pending_ && sigismember(&waiting, SIGPIPE))
+			{
+				struct timespec zero{0, 0};
+				while (sigtimedwait(&pipeset, nullptr, &zero) < 0 && errno == EINTR);
+			}
+			pthread_sigmask(SIG_SETMASK, &old_, nullptr);
+		}
+		const sigset_t &original() const { return old_; }
+	};
+
+	int sysio(const std::string &bin, const std::vector<std::string> &args, std::string_view in, const sysio_opts &opts)
+	{
+		const std::size_t chunk = 64 * 1024;
+		int infd[2] = {-1, -1}, outfd[2] = {-1, -1}, errfd[2] = {-1, -1};
+		auto closeall = [&infd, &outfd, &errfd]() { for (int *p : {infd, outfd, errfd}) for (int i : {0, 1}) if (p[i] >= 0) ::close(p[i]); };
+		if (::pipe2(infd, O_CLOEXEC) || (opts.out && ::pipe2(outfd, O_CLOEXEC)) || (opts.err && ::pipe2(errfd, O_CLOEXEC)))
+		{
+			int err = errno;
+			closeall();
+			throw std::runtime_error{"Failed to open pipe: " + std::string{::strerror(err)}};
+		}
+		sigpipe_guard sigpipe{};
+		pid_t pid;
+		try { pid = spawn(bin, args, infd[0], outfd[1], errfd[1], &sigpipe.original()); }
+		catch (...)
+		{
+			closeall();
+			throw;
+		}
+		for (int *p : {infd + 0, outfd + 1, errfd + 1}) if (*p >= 0)
+		{
+			::close(*p);
+			*p = -1;
+		}
+		for (int fd : {infd[1], outfd[0], errfd[0]}) if (fd >= 0) ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+		std::string inbuf{}, readbuf(chunk, '\0');
+		std::string_view pending = opts.input ? std::string_view{} : in;
+		bool timedout = false;
+		auto deadline = std::chrono::steady_clock::now() + opts.timeout;
+		try
+		{
+			while (infd[1] >= 0 || outfd[0] >= 0 || errfd[0] >= 0)
+			{
+				if (infd[1] >= 0 && pending.empty() && opts.input && *opts.input)
+				{
+					inbuf.resize(chunk);
+					opts.input->read(&inbuf[0], chunk);
+					inbuf.resize(opts.input->gcount());
+					pending = inbuf;
+				}
+				if (infd[1] >= 0 && pending.empty())
+				{
+					::close(infd[1]);
+					infd[1] = -1;
+					continue;
+				}
+				int wait = -1;
+				if (opts.timeout.count() > 0)
+				{
+					auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+					if (left.count() <= 0)
+					{
+						timedout = true;
+						break;
+					}
+					wait = left.count() + 1;
+				}
+				struct pollfd fds[3] = {{infd[1], POLLOUT, 0}, {outfd[0], POLLIN, 0}, {errfd[0], POLLIN, 0}}; // Negative fds are skipped
+				if (::poll(fds, 3, wait) < 0)
+				{
+					if (errno == EINTR) continue;
+					throw std::runtime_error{"Failed to poll child: " + std::string{::strerror(errno)}};
+				}
+				if (fds[0].revents)
+				{
+					ssize_t n = ::write(infd[1], pending.data(), std::min(pending.size(), chunk));
+					if (n >= 0) pending.remove_prefix(n);
+					else if (errno == EPIPE) // The child won't read any more
+					{
+						::close(infd[1]);
+						infd[1] = -1;
+					}
+					else if (errno != EAGAIN && errno != EINTR) throw std::runtime_error{"Failed to write to child: " + std::string{::strerror(errno)}};
+				}
+				for (int i : {1, 2}) if (fds[i].revents)
+				{
+					int &fd = i == 1 ? outfd[0] : errfd[0];
+					ssize_t n = ::read(fd, &readbuf[0], readbuf.size());
+					if (n > 0) (i == 1 ? opts.out : opts.err)(std::string_view{readbuf.data(), static_cast<std::size_t>(n)});
+					else if (n == 0)
+					{
+						::close(fd);
+						fd = -1;
+					}
+					else if (errno != EAGAIN && errno != EINTR) throw std::runtime_error{"Failed to read from child: " + std::string{::strerror(errno)}};
+				}
+			}
+		}
+		catch (...)
 		{
-			int count = read(outfd[0], &buf[0], buf.size());
-			if (count == 0) break;
-			if (count < 0) throw std::runtime_error{"Failed to read all output: " + std::string{strerror(errno)}};
-			out += buf.substr(0, count);
+			closeall();
+			::kill(pid, SIGKILL);
+			waitchild(pid);
+			throw;
 		}
-		close(outfd[0]);
+		closeall();
+		// The pipes can all be closed while the child runs on, so the deadline still holds for the exit
+		if (! timedout && opts.timeout.count() > 0) return waitchild(pid, deadline);
+		if (timedout) ::kill(pid, SIGKILL);
+		return waitchild(pid);
+	}
+
+	std::pair<int, std::string> sysio(const std::string &bin, const std::vector<std::string> &args, const std::string &in, bool readout)
+	{
+		std::string out{};
+		sysio_opts opts{};
+		opts.out = [&out, readout](std::string_view data) { if (readout) out += data; };
+		int ret = sysio(bin, args, std::string_view{in}, opts);
 		return std::make_pair(ret, out);
 	}
+	procpool::procpool(const std::string &bin, const std::vector<std::string> &args, std::size_t size, std::size_t prestart) : bin_{bin}, args_{args}, size_{size}, running_{0}, idle_{}, lock_{}, free_{}
+	{
+		if (size_ == 0) size_ = std::max(std::thread::hardware_concurrency(), 1u);
+		for (std::size_t i = 0; i < std::min(prestart, size_); i++)
+		{
+			idle_.push_back(start());
+			running_++;
+		}
+	}
+
+	// Helpers all get the same grace period to exit after SIGTERM, and any still running after it are killed
+	procpool::~procpool()
+	{
+		for (std::unique_ptr<helper> &h : idle_)
+		{
+			::close(h->in);
+			::close(h->out);
+			::kill(h->pid, SIGTERM);
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{1};
+		for (std::unique_ptr<helper> &h : idle_)
+		{
+			try { waitchild(h->pid, deadline); }
+			catch (std::runtime_error &) { } // Already reaped elsewhere, if SIGCHLD is ignored
+		}
+	}
+
+	std::unique_ptr<procpool::helper> procpool::start()
+	{
+		int infd[2], outfd[2];
+		if (::pipe2(infd, O_CLOEXEC)) throw std::runtime_error{"Failed to open pipe: " + std::string{::strerror(errno)}};
+		if (::pipe2(outfd, O_CLOEXEC))
+		{
+			int err = errno;
+			::close(infd[0]);
+			::close(infd[1]);
+			throw std::runtime_error{"Failed to open pipe: " + std::string{::strerror(err)}};
+		}
+		std::unique_ptr<helper> ret{new helper{-1, infd[1], outfd[0], ""}};
+		try { ret->pid = spawn(bin_, args_, infd[0], outfd[1], -1); }
+		catch (...)
+		{
+			for (int fd : {infd[0], infd[1], outfd[0], outfd[1]}) ::close(fd);
+			throw;
+		}
+		::close(infd[0]);
+		::close(outfd[1]);
+		return ret;
+	}
+
+	// Helpers are asked to stop, since they may never notice their input closing
+	void procpool::stop(helper &h, int sig)
+	{
+		::close(h.in);
+		::close(h.out);
+		::kill(h.pid, sig);
+		while (::waitpid(h.pid, nullptr, 0) < 0 && errno == EINTR);
+	}
+
+	std::string procpool::call(std::string_view request)
+	{
+		std::unique_ptr<helper> h{};
+		{
+			std::unique_lock<std::mutex> guard{lock_};
+			free_.wait(guard, [this]() { return ! idle_.empty() || running_ < size_; });
+			if (! idle_.empty())
+			{
+				h = std::move(idle_.back());
+				idle_.pop_back();
+			}
+			else running_++;
+		}
+		auto fail = [this, &h](const std::string &msg) {
+			if (h) stop(*h, SIGKILL);
+			std::lock_guard<std::mutex> guard{lock_};
+			running_--;
+			free_.notify_one();
+			return std::runtime_error{"Helper " + bin_ + " failed: " + msg};
+		};
+		try { if (! h) h = start(); }
+		catch (std::runtime_error &e) { throw fail(e.what()); }
+		std::string line{request};
+		line += '\n';
+		{
+			sigpipe_guard sigpipe{};
+			for (std::size_t done = 0; done < line.size(); )
+			{
+				ssize_t n = ::write(h->in, line.data() + done, line.size() - done);
+				if (n >= 0) done += n;
+				else if (errno != EINTR) throw fail(::strerror(errno));
+			}
+		}
+		std::size_t end, scanned = 0;
+		while ((end = h->buf.find('\n', scanned)) == std::string::npos)
+		{
+			scanned = h->buf.size();
+			h->buf.resize(scanned + 4096);
+			ssize_t n = ::read(h->out, &h->buf[scanned], 4096);
+			h->buf.resize(scanned + std::max<ssize_t>(n, 0));
+			if (n == 0) throw fail("exited before responding");
+			if (n < 0 && errno != EINTR) throw fail(::strerror(errno));
+		}
+		std::string ret = h->buf.substr(0, end);
+		h->buf.erase(0, end + 1);
+		std::lock_guard<std::mutex> guard{lock_};
+		idle_.push_back(std::move(h));
+		free_.notify_one();
+		return ret;
+	}
 }
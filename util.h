@@ -22,6 +22,11 @@
 #include <cuchar>
 #include <string.h>
 #include <glob.h>
+#include <fnmatch.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,6 +40,20 @@
 #include <fcntl.h>
 #include <cstdlib>
 #include <sys/wait.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <array>
+#include <iterator>
+#include <list>
+#include <charconv>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <memory>
+#include <exception>
+#include <future>
 
 namespace util
 {
@@ -50,6 +69,75 @@ namespace util
 
 	std::vector<std::string> strsplit(const std::string &str, const std::regex &delim);
 
+	// Substring search that precomputes what it needs from the needle once, so it can be reused across many haystacks.
+	// Single characters go through memchr, short needles through memchr on the first character, and longer ones use
+	// Horspool's skip table.  The needle is not copied and must outlive the searcher.
+	class strsearch
+	{
+	private:
+		static const std::size_t horspool_min = 4;
+		const char *data_;
+		std::size_t len_;
+		char first_;
+		unsigned char skip_[256];
+	public:
+		strsearch(std::string_view needle);
+		strsearch(char needle) : data_{nullptr}, len_{1}, first_{needle} { }
+		std::size_t find(std::string_view hay, std::size_t pos = 0) const;
+		std::size_t size() const { return len_; }
+	};
+
+	// Lazy range over the pieces of a string separated by a delimiter, yielding views into the original string.  Like
+	// strsplit, an empty input or a trailing delimiter produces an empty final piece.
+	class splitter
+	{
+	private:
+		std::string_view str_;
+		strsearch delim_;
+	public:
+		class iterator
+		{
+		private:
+			const splitter *parent_;
+			std::size_t pos_, end_;
+			void locate()
+			{
+				end_ = parent_->delim_.size() ? parent_->delim_.find(parent_->str_, pos_) : std::string_view::npos;
+				if (end_ == std::string_view::npos) end_ = parent_->str_.size();
+			}
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = std::string_view;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const std::string_view *;
+			using reference = std::string_view;
+			iterator() : parent_{nullptr}, pos_{0}, end_{0} { }
+			iterator(const splitter *parent) : parent_{parent}, pos_{0}, end_{0} { locate(); }
+			std::string_view operator*() const { return parent_->str_.substr(pos_, end_ - pos_); }
+			iterator &operator++()
+			{
+				if (end_ == parent_->str_.size()) parent_ = nullptr;
+				else
+				{
+					pos_ = end_ + parent_->delim_.size();
+					locate();
+				}
+				return *this;
+			}
+			iterator operator++(int) { iterator ret = *this; ++*this; return ret; }
+			bool operator==(const iterator &other) const { return parent_ == other.parent_ && (! parent_ || pos_ == other.pos_); }
+			bool operator!=(const iterator &other) const { return ! (*this == other); }
+		};
+		splitter(std::string_view str, std::string_view delim) : str_{str}, delim_{delim} { }
+		splitter(std::string_view str, char delim) : str_{str}, delim_{delim} { }
+		iterator begin() const { return iterator{this}; }
+		iterator end() const { return iterator{}; }
+	};
+
+	std::vector<std::string_view> strsplit_view(std::string_view str, std::string_view delim);
+
+	std::vector<std::string_view> strsplit_view(std::string_view str, char delim);
+
 	std::vector<std::string> argvec(int argc, char **argv);
 
 	std::pair<std::unordered_map<std::string, std::vector<std::string>>, std::vector<std::string>> argmap(unsigned int argc, char **argv, const std::string &valid = "", bool stop = false);
@@ -60,18 +148,82 @@ namespace util
 
 	std::string utf8upper(const std::string &str);
 
+	// Unicode simple case mapping without any dependence on the system locale.  These overloads append to out, so a
+	// buffer can be reused between calls; invalid UTF-8 is copied through unchanged.
+	void utf8lower(std::string_view str, std::string &out);
+
+	void utf8upper(std::string_view str, std::string &out);
+
+	void utf8lower_inplace(std::string &str);
+
+	void utf8upper_inplace(std::string &str);
+
 	std::string codepoint2utf8(char32_t codepoint);
 
+	void codepoint2utf8(char32_t codepoint, std::string &out); // Appends to out
+
 	int fast_atoi(const char *s);
 
 	int fast_atoi(const std::string &s);
 
-	std::string conv(const std::string &in, const std::string &from, const std::string &to);
+	std::string conv(const std::string &in, const std::string &from, const std::string &to); // Uses this thread's cached converter
+
+	bool utf8valid(std::string_view str);
+
+	// Converts from one encoding to another, keeping the iconv descriptor open between conversions.  Conversions between
+	// UTF-8 and Latin-1, and from UTF-8 to itself (which only validates), don't go through iconv at all.  A converter
+	// can only be used by one thread at a time.
+	class converter
+	{
+	private:
+		enum class path { iconv, utf8, latin1_utf8, utf8_latin1 };
+		iconv_t cd_;
+		path path_;
+		void reset();
+	public:
+		converter(const std::string &from, const std::string &to);
+		converter(const converter &orig) = delete;
+		converter(converter &&orig) : cd_{orig.cd_}, path_{orig.path_} { orig.cd_ = (iconv_t) -1; }
+		~converter();
+		// Appends all of in, converted, to out
+		void operator()(std::string_view in, std::string &out);
+		std::string operator()(std::string_view in);
+		// For converting a piece at a time: appends as much of in as forms complete characters to out, and returns how
+		// many bytes of in that was.  The rest has to be passed again at the front of the next piece.  finish appends
+		// whatever the output needs to end with after the last piece.
+		std::size_t partial(std::string_view in, std::string &out);
+		void finish(std::string &out);
+		static converter &get(const std::string &from, const std::string &to); // This thread's converter for the pair
+	};
 
 	std::string env_or(const std::string &var, const std::string &def = "");
 
 	std::string gsub(const std::string &in, const std::string &find, const std::string &replace);
 
+	// Applies many find/replace pairs in a single pass over the input using an Aho-Corasick automaton that is built once
+	// and can then be reused.  When matches overlap, the leftmost one wins, and of those the longest; text produced by a
+	// replacement is never rescanned.
+	class multisub
+	{
+	private:
+		struct scanstate
+		{
+			std::size_t scan, done, beststart;
+			int32_t state, best;
+			scanstate() : scan{0}, done{0}, beststart{0}, state{0}, best{-1} { }
+		};
+		std::array<uint16_t, 256> class_;
+		std::size_t nclass_;
+		std::vector<int32_t> next_, match_;
+		std::vector<std::size_t> depth_;
+		std::vector<std::pair<std::string, std::string>> pairs_;
+		template <typename Emit> void run(std::string_view buf, scanstate &st, bool final, Emit &&emit) const;
+	public:
+		multisub(const std::vector<std::pair<std::string, std::string>> &pairs);
+		std::string operator()(std::string_view in) const;
+		void operator()(std::istream &in, std::ostream &out, std::size_t chunk = 64 * 1024) const;
+	};
+
 	template <typename It, typename T> It find_nth(It begin, It end, const T& query, unsigned int n)
 	{
 		if (n == 0) return begin;
@@ -165,11 +317,29 @@ namespace util
 
 	void rm(const std::string &path, bool isdir = false);
 
-	void rm_recursive(const std::string &path);
+	// background: rename path to a hidden name beside it and remove that on a detached thread, returning at once.
+	//     Whatever is left of it when the process exits stays behind.
+	namespace rmopt { const int background = 1; }
+
+	// Removes path and everything under it, with sibling subtrees removed in parallel.  Symlinks are removed, never
+	// followed.  progress, if given, is called one at a time with each path removed and 0, or each path that couldn't be
+	// removed and the errno.  Returns whether everything was removed; in the background, whether the rename worked.  A
+	// path that doesn't exist counts as removed, with no call to progress.
+	bool rm_recursive(const std::string &path, const std::function<void(const std::string &, int)> &progress, int flags = 0);
+
+	void rm_recursive(const std::string &path); // Throws the first error once it has removed all it can
 
 	void mkdir(const std::string &path, int mode = 0755, bool skipexist = false);
 
-	void cp(const std::string &src, const std::string &dest);
+	// mode: give copies their source's permission bits
+	// times: give copies their source's access and modification times
+	// sparse: leave holes in the source as holes in the copy rather than writing them out as zeroes
+	// recursive: copy a directory and everything in it, with files copied concurrently.  Symlinks are recreated rather
+	//     than followed, and other special files are skipped.
+	namespace cpopt { const int mode = 1, times = 2, sparse = 4, recursive = 8; }
+
+	// Clones the file where the filesystem can share extents, and otherwise copies in the kernel where it can
+	void cp(const std::string &src, const std::string &dest, int flags = 0);
 
 	std::string exepath();
 
@@ -181,13 +351,50 @@ namespace util
 
 	bool isfile(const std::string &path); // Returns true for anything that exists but is not a directory
 
-	namespace fswopt { const int follow = 1, depth = 2; }
+	// follow: call back with the stat of symlinks' targets rather than of the links themselves
+	// depth: call back for directories after their contents rather than before
+	// unordered: walk with a pool of threads.  Callbacks may run concurrently and siblings come in no particular order,
+	//     but a directory still comes before its contents (or, with depth, after them).
+	// typeonly: when a directory entry already records its file type, don't stat it, and call back with a stat holding
+	//     only the type bits of st_mode and st_ino
+	namespace fswopt { const int follow = 1, depth = 2, unordered = 4, typeonly = 8; }
 
 	void fswalk(const std::string &path, const std::function<bool(const std::string &, const struct stat *, void *)> &fn, void *userd = nullptr, int flags = 0);
 
+	// The entries of a directory other than . and .., read in large batches with getdents64.  Names are views into the
+	// listing's own buffers, valid and NUL-terminated for as long as it lives.  The filter sees each raw entry before
+	// it's kept, so rejected entries cost nothing beyond the read.
+	class dirlist
+	{
+	public:
+		struct entry
+		{
+			std::string_view name;
+			ino_t ino;
+			unsigned char type; // DT_* constant, DT_UNKNOWN if the filesystem doesn't record it
+		};
+		using filter = std::function<bool(const entry &)>;
+		using const_iterator = std::vector<entry>::const_iterator;
+	private:
+		std::vector<std::unique_ptr<char[]>> blocks_;
+		std::vector<entry> entries_;
+		void read(int fd, const filter &test);
+	public:
+		static const std::size_t blocksize = 1 << 18;
+		static filter glob(const std::string &pattern, int flags = 0); // Flags as for fnmatch(3)
+		static filter match(const std::regex &re); // Entries whose names contain a match for re
+		dirlist(const std::string &dir, const filter &test = nullptr);
+		dirlist(int dirfd, const filter &test = nullptr); // Reads from the descriptor's current position and leaves it open
+		const_iterator begin() const { return entries_.begin(); }
+		const_iterator end() const { return entries_.end(); }
+		std::size_t size() const { return entries_.size(); }
+		bool empty() const { return entries_.empty(); }
+		const entry &operator[](std::size_t i) const { return entries_[i]; }
+	};
+
 	std::unordered_set<std::string> ls(const std::string &dir, const std::string &test = "");
 
-	std::unordered_set<std::string> recursive_ls(const std::string &base, const std::string &test = "");
+	std::unordered_set<std::string> recursive_ls(const std::string &base, const std::string &test = ""); // test is matched against each basename
 
 	std::string realpath(const std::string &path);
 
@@ -206,10 +413,22 @@ namespace util
 
 	std::string ext2mime(const std::string &path);
 
+	std::string ext2mime(const char *path);
+
+	std::string_view ext2mime(std::string_view path); // Doesn't allocate; returns an empty view for unknown extensions
+
 	std::string mimetype(const std::string &path, const std::string &data);
 
 	std::string mimetype(const std::string &path);
 
+	// Results of mimetype(path) lookups that had to go to libmagic are cached by device, inode, size, and modification
+	// time, so an unchanged file is only examined once.
+	struct mimecache_stats { std::size_t hits, misses, size; };
+
+	mimecache_stats mimetype_cache_stats();
+
+	void mimetype_cache_size(std::size_t entries); // Setting the size to zero disables the cache
+
 	std::string urlencode(const std::string &str);
 
 	std::string urldecode(const std::string &str, bool plus = false);
@@ -218,7 +437,12 @@ namespace util
 
 	std::string from_htmlent(const std::string &str);
 
-	std::string to_htmlent(const std::string &str);
+	// Which characters to_htmlent escapes: text content only needs & < >, and a quoted attribute value only & " '.
+	namespace entctx { const int text = 1, attr = 2, all = 3; }
+
+	std::string to_htmlent(const std::string &str, int ctx = entctx::all);
+
+	void to_htmlent(std::string_view str, std::string &out, int ctx = entctx::all); // Appends to out
 
 	uint32_t str2ip(const std::string &in);
 
@@ -246,6 +470,47 @@ namespace util
 	std::string timestr(const std::string &fmt = "%c", std::time_t time = std::time(nullptr));
 
 
+	// Memory
+
+	// write: map read-write and carry changes through to the file
+	// create: create the file if it doesn't exist; implies write
+	// sequential, random, willneed, hugepage: advice to the kernel about how the map will be used, which it's free to
+	//     ignore.  With none of them the map is advised random.
+	// populate: fault the whole map in before returning
+	namespace mmapopt { const int write = 1, create = 2, sequential = 4, random = 8, willneed = 16, hugepage = 32, populate = 64; }
+
+	// Maps len bytes of a file starting at offset, or everything from offset on if len is zero.  Neither has to be
+	// page-aligned.  Read-only windows are cut off at the end of the file; writable ones extend the file to cover them.
+	// An empty window leaves get() null, and a writable one can still be grown.
+	class mmap_guard
+	{
+	private:
+		int fd;
+		size_t fsize;
+		void *map;
+		int flags;
+		off_t offset;
+		size_t skew; // Distance of map past the page boundary the mapping actually starts at
+		void *mapstart() const { return static_cast<char *>(map) - skew; }
+		void advise();
+	public:
+		void *open(const std::string &fname, int flags = 0, off_t offset = 0, size_t len = 0);
+		void *get() { return map; }
+		std::string_view view() const { return std::string_view{static_cast<const char *>(map), fsize}; }
+		void *grow(size_t len); // Extends a writable map, and the file under it, to len bytes.  The map may move.
+		void sync(bool wait = true); // Writes a writable map's changes back to the file
+		void close();
+		size_t size() const { return fsize; }
+		mmap_guard() : fd{-1}, fsize{0}, map{nullptr}, flags{0}, offset{0}, skew{0} { }
+		mmap_guard(const std::string &fname, int flags = 0, off_t offset = 0, size_t len = 0) : mmap_guard{} { open(fname, flags, offset, len); }
+		mmap_guard(const mmap_guard &orig) = delete;
+		mmap_guard(mmap_guard &&orig) : fd{orig.fd}, fsize{orig.fsize}, map{orig.map}, flags{orig.flags}, offset{orig.offset}, skew{orig.skew} { orig.map = nullptr; orig.fd = -1; orig.fsize = 0; }
+		mmap_guard &operator=(const mmap_guard &orig) = delete;
+		mmap_guard &operator=(mmap_guard &&orig);
+		virtual ~mmap_guard() { close(); }
+	};
+
+
 	// Streams
 
 	class rangebuf : public std::streambuf
@@ -267,6 +532,45 @@ namespace util
 		std::streampos size() { return size_; }
 	};
 
+	// Like rangebuf, but reads straight from a file descriptor with pread, so any number of them can read one file at
+	// once.  Unless readahead is off, the next block is read in the background while the current one is consumed.  The
+	// descriptor isn't owned and has to stay open for the buffer's lifetime.
+	class fdrangebuf : public std::streambuf
+	{
+	private:
+		int fd_;
+		off_t start_, size_, pos_, nextpos_;
+		size_t blocksize_;
+		bool readahead_;
+		std::vector<char> buf_, next_;
+		std::future<ssize_t> pending_; // Read into next_ at nextpos_
+		ssize_t read(char *dest, off_t pos) const;
+		void fill(off_t pos);
+	public:
+		fdrangebuf(int fd, off_t start, off_t size, size_t blocksize = 256 * 1024, bool readahead = true);
+		fdrangebuf(const fdrangebuf &orig) = delete;
+		int_type underflow();
+		pos_type seekpos(pos_type target, std::ios_base::openmode which);
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+		std::streampos offset() { return start_; }
+		std::streampos size() { return size_; }
+	};
+
+	// Reads another stream converted from one encoding to another
+	class iconvbuf : public std::streambuf
+	{
+	private:
+		static const size_t blocksize = 64 * 1024;
+		std::istream &src_;
+		converter conv_;
+		std::string in_, out_; // in_ holds input left over from the last block
+		bool done_;
+	public:
+		iconvbuf(std::istream &src, const std::string &from, const std::string &to) : src_{src}, conv_{from, to}, in_{}, out_{}, done_{false} { }
+		iconvbuf(const iconvbuf &orig) = delete;
+		int_type underflow();
+	};
+
 	class membuf : public std::streambuf
 	{
 	public:
@@ -275,8 +579,11 @@ namespace util
 		membuf(membuf &&orig) { setg(orig.eback(), orig.gptr(), orig.egptr()); }
 		std::streampos offset() { return gptr() - eback(); }
 		std::streampos size() { return egptr() - eback(); }
+		std::string_view view() const { return std::string_view{eback(), static_cast<size_t>(egptr() - eback())}; }
 	protected:
-		std::streampos seekpos(std::streampos pos, std::ios_base::openmode mode) { setg(eback(), eback() + pos, egptr()); return pos; }
+		pos_type seekpos(pos_type pos, std::ios_base::openmode mode);
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode mode);
+		std::streamsize showmanyc() { return egptr() > gptr() ? egptr() - gptr() : -1; }
 	};
 
 	class imemstream : public std::istream
@@ -289,37 +596,73 @@ namespace util
 		imemstream(const std::string_view &buf) : buf_{const_cast<char *>(&buf[0]), buf.size()} { rdbuf(&buf_); }
 		imemstream(const imemstream &orig) = delete;
 		imemstream(imemstream &&orig) : buf_{std::move(orig.buf_)} { rdbuf(&buf_); orig.rdbuf(nullptr); }
+		std::string_view view() const { return buf_.view(); }
 	};
 
-	std::streampos streamsize(std::istream &stream);
-
-
-	// Memory
-
-	class mmap_guard
+	// Reads straight out of a mapped file.  Parsers that can take the whole file at once can skip the stream and use view.
+	class immapstream : public std::istream
 	{
 	private:
-		int fd;
-		size_t fsize;
-		void *map;
+		mmap_guard map_;
+		membuf buf_;
 	public:
-		void *open(const std::string &fname);
-		void *get() { return map; }
-		void close();
-		size_t size() { return fsize; }
-		mmap_guard() : fd{0}, fsize{0}, map{nullptr} { }
-		mmap_guard(const std::string &fname) : map{nullptr} { open(fname); }
-		mmap_guard(const mmap_guard &orig) = delete;
-		mmap_guard(mmap_guard &&orig) : fd{orig.fd}, fsize{orig.fsize}, map{orig.map} { orig.map = nullptr; }
-		virtual ~mmap_guard() { close(); }
+		immapstream(const std::string &fname, int flags = mmapopt::sequential, off_t offset = 0, size_t len = 0) : std::istream{nullptr}, map_{fname, flags & ~(mmapopt::write | mmapopt::create), offset, len}, buf_{static_cast<char *>(map_.get()), map_.size()} { rdbuf(&buf_); }
+		immapstream(const immapstream &orig) = delete;
+		immapstream(immapstream &&orig) : std::istream{std::move(orig)}, map_{std::move(orig.map_)}, buf_{std::move(orig.buf_)} { rdbuf(&buf_); orig.rdbuf(nullptr); }
+		std::string_view view() const { return map_.view(); }
 	};
 
+	std::streampos streamsize(std::istream &stream);
+
 
 	// System
 	
+	// Children are started with posix_spawnp, which doesn't copy the parent's page tables.  A command that can't be run
+	// throws rather than coming back as an exit status.
 	int system(const std::string &bin, const std::vector<std::string> &args);
 
 	std::pair<int, std::string> sysio(const std::string &bin, const std::vector<std::string> &args, const std::string &in, bool readout);
+
+	struct sysio_opts
+	{
+		std::istream *input = nullptr; // Read for the child's stdin in place of in
+		std::function<void(std::string_view)> out{}, err{}; // Given the child's output as it arrives; without them it goes to ours
+		std::chrono::milliseconds timeout{0}; // Zero for none
+	};
+
+	// Runs bin with its standard streams pumped concurrently, so that the child can produce any amount of output before
+	// it's done reading input.  Returns the wait status, which shows SIGKILL if the child had to be killed for running
+	// past the timeout, which counts until it exits and not just until it closes its output.
+	int sysio(const std::string &bin, const std::vector<std::string> &args, std::string_view in, const sysio_opts &opts);
+
+	// Long-lived helper processes running one command, each of which answers a request line on its stdin with a
+	// response line on its stdout, so that frequent small jobs don't pay for starting a process each.  call hands the
+	// request to an idle helper, starting another if fewer than size are running, or else waits for one.  A helper that
+	// dies mid-request makes that call throw, and is replaced when next needed.  Destroying the pool sends its helpers
+	// SIGTERM and kills any still running a second later.
+	class procpool
+	{
+	private:
+		struct helper
+		{
+			pid_t pid;
+			int in, out;
+			std::string buf; // Output read past the end of the last response
+		};
+		std::string bin_;
+		std::vector<std::string> args_;
+		std::size_t size_, running_;
+		std::vector<std::unique_ptr<helper>> idle_;
+		std::mutex lock_;
+		std::condition_variable free_;
+		std::unique_ptr<helper> start();
+		static void stop(helper &h, int sig);
+	public:
+		procpool(const std::string &bin, const std::vector<std::string> &args, std::size_t size = 0, std::size_t prestart = 0); // Size defaults to the number of CPUs
+		procpool(const procpool &orig) = delete;
+		~procpool();
+		std::string call(std::string_view request); // The request must not contain a newline, and the response has none
+	};
 }
 
 #endif